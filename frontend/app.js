@@ -102,23 +102,55 @@ setTimeout(function() {
     ws.send(JSON.stringify(packet));
 
     ws.onmessage = (event) => {
-        const packet = JSON.parse(event.data);
-        const type = packet['type']
-        if(type == 'pos'){
+        // Telemetry is binary, anything else is JSON
+        if(event.data instanceof ArrayBuffer){
+            const packet = parse_telemetry(event.data);
+            if(!packet) return;
             for(let i = 0; i < rod_nums.length; ++i){
                 const redrod = red_rods.children[i];
-                redrod.position.z = redrod.offset + (packet['redpos'][i]-1/2)*limits[i];
+                redrod.position.z = redrod.offset + (packet.redpos[i]-1/2)*limits[i];
                 const bluerod = blue_rods.children[i];
-                bluerod.position.z = bluerod.offset + (packet['bluepos'][i]-1/2)*limits[i];
+                bluerod.position.z = bluerod.offset + (packet.bluepos[i]-1/2)*limits[i];
 
-                red_rods.children[i].rotation.y = (packet['redrot'][i] / 360 * (2*Math.PI));
-                blue_rods.children[i].rotation.y = (packet['bluerot'][i] / 360 * (2*Math.PI));
+                red_rods.children[i].rotation.y = (packet.redrot[i] / 360 * (2*Math.PI));
+                blue_rods.children[i].rotation.y = (packet.bluerot[i] / 360 * (2*Math.PI));
             }
-            ball.position.x = (packet['ballpos'][1]) * table_height;
-            ball.position.z = (packet['ballpos'][0] - 0.5) * table_width;
+            ball.position.x = (packet.ballpos[1]) * table_height;
+            ball.position.z = (packet.ballpos[0] - 0.5) * table_width;
         }
     }
 }, 300);
+ws.binaryType = 'arraybuffer';
+
+// Matches telemetry_frame in software/telemetry.hpp, little endian
+const telemetry_version = 1;
+const num_rods = 4;
+
+function parse_telemetry(buf) {
+    const view = new DataView(buf);
+    let off = 0;
+    const u32 = () => { const v = view.getUint32(off, true); off += 4; return v; };
+    const f32s = (n) => {
+        const out = [];
+        for(let i = 0; i < n; ++i, off += 4) out.push(view.getFloat32(off, true));
+        return out;
+    };
+    if(buf.byteLength < 4 || u32() != telemetry_version){
+        console.error('Unknown telemetry version');
+        return null;
+    }
+    return {
+        seq: u32(),
+        state: u32(),
+        redpos: f32s(num_rods),
+        redrot: f32s(num_rods),
+        redvel: f32s(num_rods),
+        bluepos: f32s(num_rods),
+        bluerot: f32s(num_rods),
+        ballpos: f32s(3),
+        ballvel: f32s(3),
+    };
+}
 
 /******************************************************************************
  * Parse key presses
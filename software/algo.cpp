@@ -2,6 +2,7 @@
 #include "algo.hpp"
 #include "physical_params.hpp"
 #include <algorithm>
+#include <cmath>
 #include <iostream>
 
 using namespace std;
@@ -106,6 +107,54 @@ bool is_blocked(int start_rod, double ball_cm, double rod_pos[num_axis_t][num_ro
     return false;
 }
 
+void rods_ahead(const double rod_pos[num_axis_t][num_rod_t], const double rod_vel[num_axis_t][num_rod_t], double dt_s, double out[num_axis_t][num_rod_t]){
+    for(int r = 0; r < num_rod_t; ++r){
+        out[lin][r] = clamp(rod_pos[lin][r] + rod_vel[lin][r]*dt_s, 0.0, lin_range_cm[r]);
+        double rot_vel = clamp(rod_vel[rot][r], -rod_ahead_max_rot_vel, rod_ahead_max_rot_vel);
+        out[rot][r] = clamp(rod_pos[rot][r] + rot_vel*dt_s, -rod_ahead_max_rot, rod_ahead_max_rot);
+    }
+}
+
+double motor_pos_at(const motor_state &mtr, int axis, int rod, double t_ms){
+    const pos_series &h = mtr.history[axis][rod];
+    if(h.n == 0 || t_ms > h.get(0).t_ms) return mtr.profile[axis][rod].pos_at(t_ms);
+    return h.at(t_ms);
+}
+
+coord_plan plan_coord_move(const motor_state &mtr, int rod, const double target[num_axis_t], double t_ms, double now,
+        const double vmax[num_axis_t], const double amax[num_axis_t]){
+    trapezoid tz[num_axis_t];
+    double goal[num_axis_t];
+    double t_earliest = 0;
+    for(int a = 0; a < num_axis_t; ++a){
+        const axis_profile &prof = mtr.profile[a][rod];
+        tz[a] = prof.tz;
+        tz[a].pos = prof.pos_at(now);
+        tz[a].vel = prof.vel_at(now);
+        goal[a] = a == lin ? clamp(target[a], 0.0, lin_range_cm[rod]) : target[a];
+        t_earliest = max(t_earliest, min_time(tz[a], goal[a], vmax[a], amax[a]));
+    }
+
+    coord_plan plan;
+    double t = isnan(t_ms) ? t_earliest : (t_ms - now) / 1000;
+    plan.feasible = !isinf(t_earliest) && t >= t_earliest - 1e-6;
+    if(!plan.feasible) t = t_earliest;
+    plan.t_arrive_ms = now + t * 1000;
+    for(int a = 0; a < num_axis_t; ++a){
+        double v = vel_for_time(tz[a], goal[a], t, vmax[a], amax[a]);
+        plan.cmd[a] = {goal[a], isnan(v) ? vmax[a] : v, amax[a]};
+    }
+    return plan;
+}
+
+double track_vel(double target, double target_vel, double pos, double vel, double vmax, double amax, double lo, double hi){
+    double v = target_vel + track_kp*(target - pos) + track_kd*(target_vel - vel);
+    v = clamp(v, -vmax, vmax);
+    v = min(v, sqrt(2*amax*max(hi - pos, 0.0)));
+    v = max(v, -sqrt(2*amax*max(pos - lo, 0.0)));
+    return round(v / track_vel_step) * track_vel_step;
+}
+
 double kin_ball_dist(vector<double> ball_pos, vector<double> ball_vel, double y){
     double dt = (y - ball_pos[1])/ball_vel[1];
     double x = ball_pos[0] + ball_vel[0]*dt;
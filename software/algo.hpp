@@ -1,3 +1,4 @@
+#pragma once
 
 /******************************************************************************
  * Includes
@@ -6,6 +7,7 @@
 #include <vector>
 
 #include "physical_params.hpp"
+#include "profile.hpp"
 
 /******************************************************************************
  * Typedefs
@@ -97,8 +99,97 @@ struct motor_cmd {
     double pos;
     double vel;
     double accel;
+    // Velocity mode when set, follows this velocity instead of moving to pos.
+    // accel still applies
+    double track_vel = NAN;
 };
 
+// Snapshots passed between threads through a seqlock, so plain arrays only
+
+// Published by the QTM thread every frame
+struct vision_state {
+    double ball_pos_fast[3];
+    double ball_pos_slow[3];
+    double ball_vel[3];
+    double ball_std[3]; // 1 sigma uncertainty of ball_pos_slow
+    bool ball_in_motion; // Crude measure of whether ball is in motion
+    bool ball_predicted; // Ball not seen this frame, slow position and velocity are predicted
+    double ball_seen_ms; // Capture time the ball was last seen, host clock
+    double ball_confidence; // 1 when just seen, towards 0 as the prediction gets uncertain
+    bool ball_airborne; // In the air or still bouncing, horizontal velocity is unreliable
+    double ball_height; // Height of the ball above resting on the table, cm
+    double rod_pos[num_axis_t][num_rod_t];
+    bool rod_in_vision[num_rod_t];
+    double rod_vel[num_axis_t][num_rod_t]; // Filtered, cm/s and deg/s
+    bool rod_windup[num_rod_t]; // Rotation picking up, probably about to shoot
+    // Bot rods as seen by the cameras, rotation mirrored to match rod_pos
+    double bot_rod_pos[num_axis_t][num_rod_t];
+    bool bot_rod_in_vision[num_rod_t];
+    long n_ball_rejected; // Ball candidates thrown out by the gate, total
+    double assoc_p99_us, assoc_max_us; // Marker association cost per frame
+    double capture_ms; // Capture time of this frame on the host clock
+    double publish_ms; // Host time this snapshot was published
+    double fps; // Measured camera frame rate
+    long n_dropped;
+    double delay_p50_ms, delay_p99_ms; // Receive delay above the fastest frames
+    double qtm_time;
+};
+
+// Published by the motor thread whenever it issues a command or reads a position
+struct motor_state {
+    double cur_pos[num_axis_t][num_rod_t];
+    motor_cmd last_cmd[num_axis_t][num_rod_t];
+    double t_last_cmd[num_axis_t][num_rod_t];
+    // Where each axis should be between reads, see axis_profile
+    axis_profile profile[num_axis_t][num_rod_t];
+    // Recent measured positions, timestamped at the middle of each read
+    pos_series history[num_axis_t][num_rod_t];
+    // Moves issued so far, motion events say which one they're about
+    long n_moves[num_axis_t][num_rod_t];
+};
+
+// Published by the control loop every tick
+struct motor_cmds {
+    motor_cmd cmd[num_axis_t][num_rod_t];
+};
+
+// Published by the control loop every tick, for the status screen
+struct control_status {
+    double t_ms;
+    state_t state;
+    cmove_t cmove_task;
+    // Human rods looked ahead, as the states see them
+    double rod_pos[num_axis_t][num_rod_t];
+    // Whatever a state wants on screen while debugging, NAN when unused
+    double debug[3];
+};
+
+// Linear and rotational move of one rod timed to arrive together
+struct coord_plan {
+    bool feasible;
+    double t_arrive_ms; // Requested arrival, or the earliest possible if that's too soon
+    motor_cmd cmd[num_axis_t];
+};
+
+
+/******************************************************************************
+ * Constants
+ ******************************************************************************/
+
+// Velocity mode tracking, cm and s. Gains tuned against the simulated motors
+// following a noisy moving ball
+const double track_kp = 30; // 1/s
+const double track_kd = 0.1;
+// Velocity commands are rounded to this and sent at most every
+// track_period_ms, otherwise ball noise turns into a command every tick
+const double track_vel_step = 2;
+const double track_period_ms = 5;
+
+// Human rod rotation lookahead. A hard shot spins faster than this, but over
+// the lookahead a noisy rate would swing the rod way off, and hat rotations
+// only go to +-90 deg since they come from asin
+const double rod_ahead_max_rot_vel = 3000; // deg/s
+const double rod_ahead_max_rot = 90; // deg
 
 /******************************************************************************
  * Public Functions
@@ -141,6 +232,36 @@ pair<side_t, rod_t> closest_rod(double ball_cm);
  */
 bool is_blocked(int start_rod, double ball_cm, double rod_pos[num_axis_t][num_rod_t], double tol=0, int end_rod=-1);
 
+/**
+ * Extrapolates human rod positions dt_s ahead using their velocity, linear
+ * position clamped to the rod's range. Rotation rate is capped at
+ * rod_ahead_max_rot_vel and the result clamped to +-rod_ahead_max_rot
+ */
+void rods_ahead(const double rod_pos[num_axis_t][num_rod_t], const double rod_vel[num_axis_t][num_rod_t], double dt_s, double out[num_axis_t][num_rod_t]);
+
+/**
+ * Position of a motor axis at time t_ms. Interpolated from the measured
+ * history up to the newest sample, predicted from the motion profile after
+ */
+double motor_pos_at(const motor_state &mtr, int axis, int rod, double t_ms);
+
+/**
+ * Plans moves for both axes of rod so they get to target at the same time,
+ * t_ms (now_ms() clock), or as soon as both can if t_ms is NAN. The slower
+ * axis runs flat out and the other is slowed to match. Starts from where the
+ * motion profiles say the axes are at now. If t_ms is too soon the plan is
+ * for the earliest possible time and feasible is false
+ */
+coord_plan plan_coord_move(const motor_state &mtr, int rod, const double target[num_axis_t], double t_ms, double now,
+        const double vmax[num_axis_t], const double amax[num_axis_t]);
+
+/**
+ * Velocity command to follow target moving at target_vel: the target's
+ * velocity fed forward plus PD on where the axis is and how fast it's going.
+ * Limited to vmax and to what can still stop before either end of [lo, hi]
+ */
+double track_vel(double target, double target_vel, double pos, double vel, double vmax, double amax, double lo, double hi);
+
 /**
  * Calculates x position of ball when ball has reached location y
  * Assumes that y is in the direction of ball_vel[1]
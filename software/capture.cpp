@@ -0,0 +1,103 @@
+#include "capture.hpp"
+#include "physical_params.hpp"
+#include <cstring>
+
+using namespace std;
+
+/******************************************************************************
+ * Writer
+ ******************************************************************************/
+
+bool capture_writer::open(const string &path){
+    f = fopen(path.c_str(), "wb");
+    if(!f) return false;
+    uint32_t header[2] = {capture_version, 0};
+    fwrite(capture_magic, 1, sizeof(capture_magic), f);
+    fwrite(header, sizeof(uint32_t), 2, f);
+    return true;
+}
+
+void capture_writer::write(const capture_frame &frame){
+    if(!f) return;
+    uint32_t n = frame.markers.size();
+    fwrite(&frame.host_ms, sizeof(frame.host_ms), 1, f);
+    fwrite(&frame.qtm_us, sizeof(frame.qtm_us), 1, f);
+    fwrite(&frame.frame_number, sizeof(frame.frame_number), 1, f);
+    fwrite(&n, sizeof(n), 1, f);
+    fwrite(frame.markers.data(), sizeof(capture_marker), n, f);
+    if(++n_frames % 256 == 0) fflush(f);
+}
+
+void capture_writer::close(){
+    if(f) fclose(f);
+    f = nullptr;
+}
+
+/******************************************************************************
+ * Reader
+ ******************************************************************************/
+
+bool capture_reader::open(const string &path){
+    f = fopen(path.c_str(), "rb");
+    if(!f) return false;
+    char magic[sizeof(capture_magic)];
+    uint32_t header[2];
+    if(fread(magic, 1, sizeof(magic), f) != sizeof(magic)
+            || memcmp(magic, capture_magic, sizeof(magic)) != 0
+            || fread(header, sizeof(uint32_t), 2, f) != 2
+            || header[0] != capture_version){
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool capture_reader::read(capture_frame &frame){
+    if(!f) return false;
+    uint32_t n;
+    if(fread(&frame.host_ms, sizeof(frame.host_ms), 1, f) != 1) return false;
+    if(fread(&frame.qtm_us, sizeof(frame.qtm_us), 1, f) != 1) return false;
+    if(fread(&frame.frame_number, sizeof(frame.frame_number), 1, f) != 1) return false;
+    if(fread(&n, sizeof(n), 1, f) != 1) return false;
+    frame.markers.resize(n);
+    return fread(frame.markers.data(), sizeof(capture_marker), n, f) == n;
+}
+
+void capture_reader::rewind(){
+    if(f) fseek(f, sizeof(capture_magic) + 2*sizeof(uint32_t), SEEK_SET);
+}
+
+void capture_reader::close(){
+    if(f) fclose(f);
+    f = nullptr;
+}
+
+/******************************************************************************
+ * Misc
+ ******************************************************************************/
+
+capture_marker table_to_qtm(const qtm_calibration &cal, const double pos[3], uint32_t id){
+    // table = A qtm + t, so qtm = A^-1 (table - t), inverse from the adjugate
+    const auto &m = cal.m;
+    double a[3][3], p[3];
+    for(int i = 0; i < 3; ++i){
+        for(int j = 0; j < 3; ++j) a[i][j] = m[i][j];
+        p[i] = pos[i] - m[i][3];
+    }
+    double inv[3][3] = {
+        {a[1][1]*a[2][2] - a[1][2]*a[2][1], a[0][2]*a[2][1] - a[0][1]*a[2][2], a[0][1]*a[1][2] - a[0][2]*a[1][1]},
+        {a[1][2]*a[2][0] - a[1][0]*a[2][2], a[0][0]*a[2][2] - a[0][2]*a[2][0], a[0][2]*a[1][0] - a[0][0]*a[1][2]},
+        {a[1][0]*a[2][1] - a[1][1]*a[2][0], a[0][1]*a[2][0] - a[0][0]*a[2][1], a[0][0]*a[1][1] - a[0][1]*a[1][0]},
+    };
+    double det = a[0][0]*inv[0][0] + a[0][1]*inv[1][0] + a[0][2]*inv[2][0];
+    double q[3];
+    for(int i = 0; i < 3; ++i)
+        q[i] = (inv[i][0]*p[0] + inv[i][1]*p[1] + inv[i][2]*p[2]) / det;
+    capture_marker ret;
+    ret.x = q[0];
+    ret.y = q[1];
+    ret.z = q[2];
+    ret.id = id;
+    return ret;
+}
+
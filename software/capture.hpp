@@ -0,0 +1,85 @@
+#pragma once
+
+/******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "vision.hpp"
+
+using namespace std;
+
+/******************************************************************************
+ * Capture format
+ ******************************************************************************/
+
+/*
+ * Binary capture of the raw QTM 3D no label frames, little endian:
+ *
+ * File header:
+ *   char     magic[8]      "FBQTMCAP"
+ *   uint32_t version       capture_version
+ *   uint32_t reserved
+ *
+ * Each frame:
+ *   double   host_ms       mgr.TimeStampMsec() when the frame was received
+ *   uint64_t qtm_us        QTM capture timestamp
+ *   uint32_t frame_number  QTM frame number
+ *   uint32_t n_markers
+ *   n_markers * { float x, y, z; uint32_t id; }  raw QTM coordinates in mm
+ */
+
+const char capture_magic[8] = {'F','B','Q','T','M','C','A','P'};
+const uint32_t capture_version = 1;
+
+struct capture_marker {
+    float x, y, z;
+    uint32_t id;
+};
+
+struct capture_frame {
+    double host_ms;
+    uint64_t qtm_us;
+    uint32_t frame_number;
+    vector<capture_marker> markers;
+};
+
+/**
+ * Appends frames to a capture file. Writes go through stdio buffering so this
+ * is cheap enough to leave on in the QTM thread. Flushed every so often since
+ * foosbar usually exits through terminate()
+ */
+struct capture_writer {
+    FILE *f = nullptr;
+    long n_frames = 0;
+
+    bool open(const string &path);
+    void write(const capture_frame &frame);
+    void close();
+    ~capture_writer() { close(); }
+};
+
+/**
+ * Reads frames back from a capture file
+ */
+struct capture_reader {
+    FILE *f = nullptr;
+
+    bool open(const string &path);
+    // Returns false at end of file or on a truncated frame
+    bool read(capture_frame &frame);
+    void rewind();
+    void close();
+    ~capture_reader() { close(); }
+};
+
+/**
+ * Converts a table coordinate (cm, table convention) to raw QTM mm, the
+ * inverse of cal as applied in the QTM thread. Used for synthetic data
+ */
+capture_marker table_to_qtm(const qtm_calibration &cal, const double pos[3], uint32_t id = 0);
+
@@ -0,0 +1,225 @@
+#include "estimator.hpp"
+#include <cmath>
+
+using namespace std;
+
+/******************************************************************************
+ * Ball window
+ ******************************************************************************/
+
+ball_window::ball_window(){
+    // Summed in the same order as the old rescan so the outputs match exactly
+    for(int i = 0; i < n_terms; ++i){
+        denom_vel += exp(-gamma_vel * i);
+        denom_pos += exp(-gamma_pos * i);
+    }
+    w_vel = exp(-gamma_vel);
+    w_pos = exp(-gamma_pos);
+    w_vel_last = exp(-gamma_vel * n_terms);
+    w_pos_last = exp(-gamma_pos * n_terms);
+}
+
+const array<double, 3> &ball_window::at(int i) const {
+    return buf[(head - i + n_pos) % n_pos];
+}
+
+void ball_window::push(const double p[3]){
+    // Terms falling off the end of the window
+    // Velocity term n_terms-1 uses positions n_terms-1 and n_terms,
+    // position term n_terms-1 uses just position n_terms-1
+    //
+    // Important: using host receive timestamps seems like it should be better, but it actually isn't
+    // Network delay is unpredictable, so sometimes timing we get it doesn't represent
+    // timing the video was captured. This can give extraneous high spikes in velocity.
+    // It does however rely on having a hardcoded fps which isn't ideal
+    for(int j = 0; j < 3; ++j){
+        double vel_drop = size > n_terms ? at(n_terms-1)[j] - at(n_terms)[j] : 0;
+        double pos_drop = size >= n_terms ? at(n_terms-1)[j] : 0;
+        double vel_new = size > 0 ? (p[j] - at(0)[j]) * vision_fps : 0;
+
+        sum_vel[j] = vel_new + w_vel*sum_vel[j] - w_vel_last*vel_drop*vision_fps;
+        sum_pos[j] = p[j] + w_pos*sum_pos[j] - w_pos_last*pos_drop;
+    }
+
+    head = (head + 1) % n_pos;
+    for(int j = 0; j < 3; ++j) buf[head][j] = p[j];
+    if(size < n_pos) ++size;
+    if(count < ewma_buf_cap) ++count;
+
+    x_max.push(p[0]);
+    y_max.push(p[1]);
+    x_min.push(-p[0]);
+    y_min.push(-p[1]);
+}
+
+bool ball_window::in_motion() const {
+    // Bounds seeded the same way the old rescan did
+    double max_x = std::max(0.0, x_max.max()), min_x = std::min(play_height, -x_min.max());
+    double max_y = std::max(-play_width/2, y_max.max()), min_y = std::min(play_width/2, -y_min.max());
+    return max_x - min_x > 1 || max_y - min_y > 1;
+}
+
+/******************************************************************************
+ * Kalman filter
+ ******************************************************************************/
+
+void reflect_walls(double &x, double &v){
+    // Loop in case of absurd dt, same convention as kin_ball_dist
+    if(!isfinite(x)) return;
+    while(x < 0 || x > play_height){
+        if(x < 0) x = -x;
+        else x = 2*play_height - x;
+        v = -v;
+    }
+}
+
+void kalman_axis::reset(double x0, double var_x, double var_v){
+    x = x0;
+    v = 0;
+    P[0][0] = var_x;
+    P[0][1] = P[1][0] = 0;
+    P[1][1] = var_v;
+}
+
+void kalman_axis::predict(double dt, double accel_std, double accel){
+    x += v*dt + accel*dt*dt/2;
+    v += accel*dt;
+
+    // P = F P F^T + Q, F = [[1, dt], [0, 1]]
+    double q = accel_std*accel_std;
+    double p00 = P[0][0] + dt*(P[0][1] + P[1][0]) + dt*dt*P[1][1];
+    double p01 = P[0][1] + dt*P[1][1];
+    double p11 = P[1][1];
+    P[0][0] = p00 + q*dt*dt*dt*dt/4;
+    P[0][1] = P[1][0] = p01 + q*dt*dt*dt/2;
+    P[1][1] = p11 + q*dt*dt;
+}
+
+double kalman_axis::update(double z, double meas_std){
+    double y = z - x;
+    double s = P[0][0] + meas_std*meas_std;
+    double k0 = P[0][0] / s, k1 = P[1][0] / s;
+
+    x += k0*y;
+    v += k1*y;
+
+    double p00 = (1-k0)*P[0][0];
+    double p01 = (1-k0)*P[0][1];
+    double p11 = P[1][1] - k1*P[0][1];
+    P[0][0] = p00;
+    P[0][1] = P[1][0] = p01;
+    P[1][1] = p11;
+
+    return abs(y) / sqrt(s);
+}
+
+// Bounce a falling ball off the table, losing some of its speed
+void bounce_table(kalman_axis &a){
+    if(a.x >= ball_rad || a.v >= 0) return;
+    a.x = 2*ball_rad - a.x;
+    a.v = -ball_restitution*a.v;
+}
+
+void ball_kalman::predict(double dt){
+    if(!initialized) return;
+    for(int j = 0; j < 2; ++j) ax[j].predict(dt, kf_accel_std);
+    ax[2].predict(dt, kf_accel_std, airborne ? -gravity : 0);
+    // Reflection negates both x and v, so covariance is unchanged
+    reflect_walls(ax[0].x, ax[0].v);
+    if(airborne) bounce_table(ax[2]);
+}
+
+void ball_kalman::update(const double pos[3]){
+    const double init_vel_std = 100;
+    if(!initialized){
+        for(int j = 0; j < 3; ++j)
+            ax[j].reset(pos[j], kf_meas_std*kf_meas_std, init_vel_std*init_vel_std);
+        initialized = true;
+        return;
+    }
+
+    // Hysteresis so noise around the threshold doesn't toggle it
+    double dz = pos[2] - ball_rad;
+    if(!airborne && dz > ball_airborne_dz){
+        airborne = true;
+    } else if(airborne && dz < ball_airborne_dz/2){
+        airborne = false;
+        settle = ball_settle_frames;
+    } else if(settle > 0){
+        --settle;
+    }
+
+    for(int j = 0; j < 3; ++j){
+        bool spiky = j < 2 && unsettled();
+        double innovation = ax[j].update(pos[j], spiky ? kf_air_meas_std : kf_meas_std);
+        // Ball was probably hit, snap to measurement and stop trusting the old velocity.
+        // Velocity restarts from 0 with a wide variance, so the next couple of
+        // frames set it. Not while it's in the air though, jumps there are mostly the marker
+        if(innovation > kf_hit_gate && !spiky)
+            ax[j].reset(pos[j], kf_meas_std*kf_meas_std, init_vel_std*init_vel_std);
+    }
+}
+
+void ball_kalman::hold(){
+    for(int j = 0; j < 3; ++j) ax[j].v = 0;
+}
+
+ball_state ball_kalman::estimate(double dt) const {
+    ball_state ret;
+    for(int j = 0; j < 3; ++j){
+        kalman_axis a = ax[j];
+        double accel = j == 2 && airborne ? -gravity : 0;
+        if(dt > 0) a.predict(dt, kf_accel_std, accel);
+        if(j == 0) reflect_walls(a.x, a.v);
+        if(j == 2 && airborne) bounce_table(a);
+        ret.pos[j] = a.x;
+        ret.vel[j] = a.v;
+        ret.pos_std[j] = sqrt(a.P[0][0]);
+        ret.vel_std[j] = sqrt(a.P[1][1]);
+    }
+    return ret;
+}
+
+/******************************************************************************
+ * Rod tracker
+ ******************************************************************************/
+
+void rod_tracker::predict(double dt){
+    if(!initialized) return;
+    ax[lin].predict(dt, rod_lin_accel_std);
+    ax[rot].predict(dt, rod_rot_accel_std);
+    // Lost the hat, don't let the rod fly off
+    if(++misses > rod_max_misses){
+        ax[lin].v = ax[rot].v = 0;
+        windup = false;
+    }
+}
+
+void rod_tracker::update(double lin_cm, double rot_deg){
+    misses = 0;
+    if(!initialized){
+        ax[lin].reset(lin_cm, rod_lin_meas_std*rod_lin_meas_std, 0);
+        ax[rot].reset(rot_deg, rod_rot_meas_std*rod_rot_meas_std, 0);
+        initialized = true;
+        return;
+    }
+    ax[lin].update(lin_cm, rod_lin_meas_std);
+    ax[rot].update(rot_deg, rod_rot_meas_std);
+
+    double rate = abs(ax[rot].v);
+    double prev = rate_hist[rate_idx];
+    rate_hist[rate_idx] = rate;
+    rate_idx = (rate_idx + 1) % windup_frames;
+    bool rising = rate > windup_min_rate && rate - prev > windup_min_rise;
+    // Stays flagged for the rest of the swing
+    windup = rising || (windup && rate > windup_min_rate);
+}
+
+/******************************************************************************
+ * Misc
+ ******************************************************************************/
+
+double ball_confidence(const ball_state &s){
+    double var = s.pos_std[0]*s.pos_std[0] + s.pos_std[1]*s.pos_std[1];
+    return ball_conf_std*ball_conf_std / (ball_conf_std*ball_conf_std + var);
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+/******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <array>
+
+#include "physical_params.hpp"
+
+/******************************************************************************
+ * Constants
+ ******************************************************************************/
+
+// Number of frames kept for the EWMA
+const int ewma_buf_cap = vision_fps;
+// Number of frames looked at to decide whether ball is moving
+const int motion_window = vision_fps / 3;
+
+// Higher = more noise, less latency
+const double gamma_vel = 0.2;
+/* const double gamma_vel = 0.05; */
+/* const double gamma_pos = 0.05; */
+const double gamma_pos = 0.1;
+
+// Kalman tuning, all in cm and s
+// White noise acceleration, ball mostly rolls so this is pretty small
+const double kf_accel_std = 300;
+const double kf_meas_std = 0.1;
+// Innovations bigger than this many std devs are treated as the ball being hit
+const double kf_hit_gate = 5;
+
+// Vertical, the ball's center sits at ball_rad when it's on the table
+const double gravity = 981; // cm/s^2
+const double ball_restitution = 0.5;
+// More than this above resting height is airborne, back under half of it is landed
+const double ball_airborne_dz = 0.8;
+// Frames after landing where the ball still counts as bouncing
+const int ball_settle_frames = vision_fps / 20;
+// Horizontal measurement noise while airborne/bouncing. The marker jumps
+// around as the ball goes past rods and players, so don't trust it as much
+const double kf_air_meas_std = 1.5;
+
+// While the ball is occluded we coast along the predicted trajectory, past
+// this it's probably stopped under a foot so we stop extrapolating
+const double ball_max_occlusion_ms = 250;
+// Position uncertainty (cm) at which confidence drops to 0.5
+const double ball_conf_std = 1;
+
+// Human rods from the hat markers, cm and deg. People throw rods around a lot
+// harder than the ball rolls
+const double rod_lin_accel_std = 3000;
+const double rod_rot_accel_std = 2e4;
+const double rod_lin_meas_std = 0.2;
+const double rod_rot_meas_std = 2;
+// Rod not seen for this many frames, stop extrapolating it
+const int rod_max_misses = vision_fps / 20;
+// Wind-up: rotation rate above windup_min_rate (deg/s) and up by windup_min_rise
+// over the last windup_frames frames, lasts until the rate drops back under
+const double windup_min_rate = 300;
+const double windup_min_rise = 200;
+const int windup_frames = 3;
+
+/******************************************************************************
+ * Typedefs
+ ******************************************************************************/
+
+/**
+ * Sliding max over the last N samples using a monotonic deque in a fixed
+ * array, so every push is amortized O(1) and never allocates
+ */
+template<int N>
+struct sliding_max {
+    array<pair<long, double>, N> buf;
+    long head = 0, tail = 0, seq = 0;
+
+    void push(double v){
+        // Drop expired samples first so there's always room
+        while(tail > head && buf[head % N].first <= seq - N) ++head;
+        while(tail > head && buf[(tail-1) % N].second <= v) --tail;
+        buf[tail++ % N] = {seq++, v};
+    }
+
+    double max() const {
+        return buf[head % N].second;
+    }
+};
+
+/**
+ * Incremental version of the EWMA over the last ewma_buf_cap frames. Holds
+ * positions in a ring buffer and updates the weighted sums recursively, so
+ * each frame costs the same no matter how large the window is. Outputs match
+ * the old full rescan of the position deque
+ */
+struct ball_window {
+    // Window is one shorter than the buffer cap, we only have ewma_buf_cap-1
+    // positions and ewma_buf_cap-2 velocity terms when it's full
+    static const int n_pos = ewma_buf_cap - 1;
+    static const int n_terms = n_pos - 1;
+
+    array<array<double, 3>, n_pos> buf;
+    int head = 0; // Index of most recent position
+    int size = 0;
+    long count = 0; // Total pushes, saturates once we're ready
+
+    double sum_vel[3] = {0,0,0}, sum_pos[3] = {0,0,0};
+
+    // Precomputed weights
+    double denom_vel = 0, denom_pos = 0;
+    double w_vel, w_pos, w_vel_last, w_pos_last;
+
+    sliding_max<motion_window> x_max, y_max, x_min, y_min;
+
+    ball_window();
+
+    /**
+     * Adds a new ball position, most recent first like the old deque
+     */
+    void push(const double pos[3]);
+
+    /**
+     * ith most recent position
+     */
+    const array<double, 3> &at(int i) const;
+
+    bool empty() const { return size == 0; }
+    bool ready() const { return count >= ewma_buf_cap; }
+
+    double pos(int j) const { return sum_pos[j] / denom_pos; }
+    double vel(int j) const { return sum_vel[j] / denom_vel; }
+
+    /**
+     * Crude measure of whether ball has moved more than 1cm recently
+     */
+    bool in_motion() const;
+};
+
+/**
+ * Constant velocity Kalman filter along a single axis
+ */
+struct kalman_axis {
+    double x = 0, v = 0;
+    double P[2][2] = {{0,0},{0,0}};
+
+    void reset(double x0, double var_x, double var_v);
+    // accel: known acceleration, e.g. gravity
+    void predict(double dt, double accel_std, double accel = 0);
+    // Returns the normalized innovation (in std devs)
+    double update(double z, double meas_std);
+};
+
+/**
+ * Ball state in table coordinates, along with 1 sigma uncertainty
+ */
+struct ball_state {
+    double pos[3];
+    double vel[3];
+    double pos_std[3];
+    double vel_std[3];
+};
+
+/**
+ * Constant velocity Kalman filter for the ball. The x axis reflects off the
+ * side walls, the same model kin_ball_dist uses. Each axis is independent so
+ * it's just three 2-state filters.
+ *
+ * z tracks jump shots and hard clears: while airborne the ball falls under
+ * gravity and bounces off the table. Horizontal measurements are trusted less
+ * until the ball has settled, so the spikes those produce don't turn into a
+ * phantom trajectory
+ */
+struct ball_kalman {
+    kalman_axis ax[3];
+    bool initialized = false;
+    bool airborne = false;
+    int settle = 0; // Frames left until the ball counts as settled after landing
+
+    /**
+     * Advance the filter by dt seconds without a measurement
+     */
+    void predict(double dt);
+
+    /**
+     * Fuse a measured ball position, should be called after predict
+     */
+    void update(const double pos[3]);
+
+    /**
+     * Zero the velocity but keep the uncertainty, for when we've lost the
+     * ball for too long to keep extrapolating
+     */
+    void hold();
+
+    /**
+     * Airborne or still bouncing, horizontal velocity is unreliable
+     */
+    bool unsettled() const { return airborne || settle > 0; }
+
+    /**
+     * Filter state propagated dt seconds ahead, without modifying the filter.
+     * Used to cover vision/network latency
+     */
+    ball_state estimate(double dt = 0) const;
+};
+
+/**
+ * Linear and angular position/velocity of one human rod, from its hat. Also
+ * flags a shot wind-up from the rotation rate picking up, which comes a good
+ * 20-50 ms before the ball starts moving
+ */
+struct rod_tracker {
+    kalman_axis ax[num_axis_t];
+    bool initialized = false;
+    int misses = 0;
+    // Rotation rate over the last windup_frames frames, ring buffer
+    double rate_hist[windup_frames] = {};
+    int rate_idx = 0;
+    bool windup = false;
+
+    /**
+     * Advance by dt seconds, call every frame whether or not the hat was seen
+     */
+    void predict(double dt);
+
+    /**
+     * Fuse the hat's measured position, lin cm and rot deg like rod_pos
+     */
+    void update(double lin_cm, double rot_deg);
+
+    double pos(int axis) const { return ax[axis].x; }
+    double vel(int axis) const { return ax[axis].v; }
+};
+
+/**
+ * How much to trust a ball estimate, 1 for a fresh measurement falling
+ * towards 0 as the position uncertainty grows
+ */
+double ball_confidence(const ball_state &s);
+
+/**
+ * Reflect x/vx off the side walls of the table
+ */
+void reflect_walls(double &x, double &v);
@@ -0,0 +1,114 @@
+#pragma once
+
+/******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+using namespace std;
+
+/******************************************************************************
+ * Seqlock
+ ******************************************************************************/
+
+/**
+ * Single writer, multi reader versioned snapshot. The writer never blocks and
+ * readers retry if they overlapped a write. Data is stored as relaxed atomic
+ * words so a torn read is never a data race, just a retry
+ */
+template<class T>
+struct seqlock {
+    static_assert(is_trivially_copyable_v<T>, "seqlock needs a trivially copyable type");
+    static const size_t n_words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    atomic<uint64_t> seq{0};
+    atomic<uint64_t> words[n_words] = {};
+
+    // Stats, only for display
+    atomic<uint64_t> n_reads{0}, n_retries{0};
+
+    void publish(const T &val){
+        uint64_t buf[n_words] = {};
+        memcpy(buf, &val, sizeof(T));
+
+        uint64_t s = seq.load(memory_order_relaxed);
+        seq.store(s + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        for(size_t i = 0; i < n_words; ++i)
+            words[i].store(buf[i], memory_order_relaxed);
+        seq.store(s + 2, memory_order_release);
+    }
+
+    T read(){
+        uint64_t buf[n_words];
+        for(;;){
+            uint64_t s0 = seq.load(memory_order_acquire);
+            if(!(s0 & 1)){
+                for(size_t i = 0; i < n_words; ++i)
+                    buf[i] = words[i].load(memory_order_relaxed);
+                atomic_thread_fence(memory_order_acquire);
+                if(seq.load(memory_order_relaxed) == s0) break;
+            }
+            n_retries.fetch_add(1, memory_order_relaxed);
+        }
+        n_reads.fetch_add(1, memory_order_relaxed);
+
+        T ret;
+        memcpy(&ret, buf, sizeof(T));
+        return ret;
+    }
+
+    /**
+     * Number of completed publishes
+     */
+    uint64_t version() const {
+        return seq.load(memory_order_acquire) / 2;
+    }
+};
+
+
+/******************************************************************************
+ * SPSC ring
+ ******************************************************************************/
+
+/**
+ * Bounded single producer, single consumer queue. Fixed storage, nothing is
+ * allocated after construction, and push/pop never block. N must be a power
+ * of two
+ */
+template<class T, int N>
+struct spsc_ring {
+    static_assert((N & (N - 1)) == 0, "spsc_ring size must be a power of two");
+    static_assert(is_trivially_copyable_v<T>, "spsc_ring needs a trivially copyable type");
+
+    // Own cache lines so producer and consumer don't fight over them
+    alignas(64) atomic<uint64_t> head{0}; // Next to pop, written by consumer
+    alignas(64) atomic<uint64_t> tail{0}; // Next to push, written by producer
+    T buf[N];
+
+    // Producer side, returns false if full
+    bool push(const T &val){
+        uint64_t t = tail.load(memory_order_relaxed);
+        if(t - head.load(memory_order_acquire) == N) return false;
+        buf[t % N] = val;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer side, returns false if empty
+    bool pop(T &val){
+        uint64_t h = head.load(memory_order_relaxed);
+        if(h == tail.load(memory_order_acquire)) return false;
+        val = buf[h % N];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+    }
+};
@@ -0,0 +1,61 @@
+#include "log.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+/******************************************************************************
+ * Event log
+ ******************************************************************************/
+
+size_t format_record(const log_record &rec, char *buf, size_t len){
+    size_t n = 0;
+    int arg = 0;
+    auto put = [&](int w){ if(w > 0) n = min(n + w, len - 1); };
+    for(const char *p = rec.fmt; *p && n < len - 1;){
+        if(*p != '%'){
+            buf[n++] = *p++;
+            continue;
+        }
+        if(p[1] == '%'){
+            buf[n++] = '%';
+            p += 2;
+            continue;
+        }
+        // Flags, width, precision and length up to the conversion
+        const char *start = p++;
+        while(*p && !strchr("diouxXeEfFgGaAcs", *p)) ++p;
+        if(!*p || arg >= rec.n_args) break;
+        char conv = *p++;
+
+        char spec[32];
+        size_t spec_len = min<size_t>(p - start - 1, sizeof(spec) - 4);
+        memcpy(spec, start, spec_len);
+        // Drop any length modifiers, the type comes from the record
+        while(spec_len > 1 && strchr("hlLqjzt", spec[spec_len - 1])) --spec_len;
+
+        const log_arg &a = rec.args[arg++];
+        if(a.is_str){
+            spec[spec_len] = 's';
+            spec[spec_len + 1] = 0;
+            put(snprintf(buf + n, len - n, spec, conv == 's' ? a.s : "?"));
+        } else if(conv == 'c'){
+            spec[spec_len] = 'c';
+            spec[spec_len + 1] = 0;
+            put(snprintf(buf + n, len - n, spec, (int)a.d));
+        } else if(strchr("diouxX", conv)){
+            spec[spec_len] = 'l';
+            spec[spec_len + 1] = 'l';
+            spec[spec_len + 2] = conv;
+            spec[spec_len + 3] = 0;
+            put(snprintf(buf + n, len - n, spec, (long long)a.d));
+        } else {
+            spec[spec_len] = conv == 's' ? 'g' : conv;
+            spec[spec_len + 1] = 0;
+            put(snprintf(buf + n, len - n, spec, a.d));
+        }
+    }
+    buf[n] = 0;
+    return n;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+/******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <atomic>
+#include <cstddef>
+
+#include "lockfree.hpp"
+
+using namespace std;
+
+/******************************************************************************
+ * Constants
+ ******************************************************************************/
+
+const int log_max_args = 6;
+// About a second of the control loop logging every tick
+const int log_ring_len = 1024;
+
+/******************************************************************************
+ * Event log
+ ******************************************************************************/
+
+struct log_arg {
+    bool is_str;
+    union {
+        double d;
+        const char *s;
+    };
+};
+
+/**
+ * One log line, unformatted. fmt and any string args have to outlive the
+ * record, string literals or static tables like rod_names
+ */
+struct log_record {
+    double t_ms;
+    const char *fmt;
+    int n_args;
+    log_arg args[log_max_args];
+};
+
+inline log_arg to_log_arg(const char *s){ log_arg a; a.is_str = true; a.s = s; return a; }
+inline log_arg to_log_arg(double d){ log_arg a; a.is_str = false; a.d = d; return a; }
+
+/**
+ * Log written from the control tick. add() just copies the format pointer and
+ * arguments into a preallocated ring, formatting and I/O happen on whatever
+ * thread drains it. Single producer, single consumer
+ */
+struct event_log {
+    spsc_ring<log_record, log_ring_len> ring;
+    atomic<long> n_dropped{0};
+
+    /**
+     * printf style, but numbers are stored as double. Floating point and
+     * integer conversions both work, %s takes a const char *
+     */
+    template<class... Args>
+    void add(double t_ms, const char *fmt, Args... args){
+        static_assert(sizeof...(Args) <= log_max_args, "too many log arguments");
+        log_record rec = {t_ms, fmt, (int)sizeof...(Args), {to_log_arg(args)...}};
+        if(!ring.push(rec)) n_dropped.fetch_add(1, memory_order_relaxed);
+    }
+
+    bool pop(log_record &rec){ return ring.pop(rec); }
+};
+
+/**
+ * Formats rec into buf like snprintf, always nul terminated. Returns the
+ * length written
+ */
+size_t format_record(const log_record &rec, char *buf, size_t len);
@@ -20,10 +20,7 @@
 #include <iostream>
 #include <algorithm>
 #include <deque>
-#include <queue>
-
-#include <clearpath/pubMotion.h>
-#include <clearpath/pubSysCls.h>
+#include <memory>
 
 #include <qualisys_cpp_sdk/RTProtocol.h>
 #include <qualisys_cpp_sdk/RTPacket.h>
@@ -34,6 +31,15 @@
 
 #include "physical_params.hpp"
 #include "algo.hpp"
+#include "estimator.hpp"
+#include "lockfree.hpp"
+#include "log.hpp"
+#include "capture.hpp"
+#include "vision.hpp"
+#include "motor.hpp"
+#include "rt.hpp"
+#include "telemetry.hpp"
+#include "timing.hpp"
 
 using namespace std;
 using json = nlohmann::json;
@@ -45,21 +51,16 @@ using json = nlohmann::json;
 #define ever ;;
 #define eps 1e-3
 
-const int init_vel_lin_cm_s = 100;
-const int init_accel_lin_cm_ss = 1000;
-
-const int init_vel_rot_deg_s = 5000;
-const int init_accel_rot_deg_ss = 50000;
-
-const int homing_timeout_ms = 10000;
-
-/******************************************************************************
- * Global Variables
- ******************************************************************************/
-
-// Might not want these to be global later, whatever for now
-sFnd::SysManager mgr;
-vector<reference_wrapper<sFnd::INode>> nodes[num_axis_t];
+// How far ahead to extrapolate human rods, roughly how long one of our shots
+// takes to get to them
+const double rod_lookahead_ms = 30;
+// How far ahead to lead the ball when a human rod is winding up for a shot
+const double windup_lead_ms = 40;
+// How long the control loop waits at startup for motor samples and a first
+// QTM frame before starting without them
+const double startup_wait_ms = 3000;
+// Dashboard redraw and log flush, 20Hz
+const double status_period_ms = 50;
 
 /******************************************************************************
  * Definitions
@@ -71,205 +72,22 @@ void onHighSChange(int, void*) {}
 void onLowVChange(int, void*) {}
 void onHighVChange(int, void*) {}
 
-/******************************************************************************
- * Motor Wrappers
- ******************************************************************************/
-
-
-void move_lin(int rod, double position_cm){
-    /* if(rod != three_bar) return; */
-    int target_cnts = clamp(
-            (int)(-lin_cm_to_cnts[rod] * position_cm),
-            min(lin_range_cnts[rod][0], lin_range_cnts[rod][1]),
-            max(lin_range_cnts[rod][0], lin_range_cnts[rod][1])
-    );
-    nodes[lin][rod].get().Motion.MovePosnStart(target_cnts, true);
-}
-
-void move_rot(int rod, double position_deg){
-    /* if(rod != three_bar) return; */
-    int target_cnts = rot_deg_to_cnts[rod] * (position_deg - cal_rot);
-    nodes[rot][rod].get().Motion.MovePosnStart(target_cnts, true);
-}
-
-function<void(int, double)> mtr_move[num_axis_t] = {move_lin, move_rot};
-
-void set_speed_lin(int rod, double vel_cm_per_s, double acc_cm_per_s2){
-    nodes[lin][rod].get().Motion.VelLimit = abs(vel_cm_per_s * lin_cm_to_cnts[rod]);
-    nodes[lin][rod].get().Motion.AccLimit = abs(acc_cm_per_s2 * lin_cm_to_cnts[rod]);
-}
-
-void set_speed_rot(int rod, double vel_deg_per_s, double acc_deg_per_s2){
-    nodes[rot][rod].get().Motion.VelLimit = vel_deg_per_s * rot_deg_to_cnts[rod];
-    nodes[rot][rod].get().Motion.AccLimit = acc_deg_per_s2 * rot_deg_to_cnts[rod];
-}
-
-function<void(int, double, double)> mtr_set_speed[num_axis_t] = {set_speed_lin, set_speed_rot};
-
-void close_all(){
-    sFnd::IPort&port = mgr.Ports(0);
-    for(int i = 0; i < port.NodeCount(); ++i){
-        port.Nodes(i).EnableReq(false);
-    }
-    mgr.PortsClose();
-}
-
-int motors_init(){
-    vector<string> comHubPorts;
-
-    // Identify hubs
-    sFnd::SysManager::FindComHubPorts(comHubPorts);
-    printf("Found %zu SC Hubs\n", comHubPorts.size());
-
-    // Find available ports
-    size_t portCount = 0;
-    for (portCount = 0; portCount < comHubPorts.size() && portCount < NET_CONTROLLER_MAX; portCount++) {
-        mgr.ComHubPort(portCount, comHubPorts[portCount].c_str(), MN_BAUD_48X);
-    }
-
-    if (portCount < 0) {
-        printf("Unable to locate SC hub port\n");
-        return -1;
-    }
-
-    // Open ports (hubs)
-    mgr.PortsOpen(portCount);
-
-    sFnd::IPort &port = mgr.Ports(0);
-    printf(" Port[%d]: state=%d, nodes=%d\n",
-        port.NetNumber(), port.OpenState(), port.NodeCount());
-
-    // Arrange nodes
-    for(int i = 0; i < num_rod_t; ++i){
-        string lin_name = "lin-" + rod_names[i];
-        string rot_name = "rot-" + rod_names[i];
-        bool lin_found = false, rot_found = false;
-
-        // Search to find correct names
-        for(int j = 0; j < port.NodeCount(); ++j){
-            string name = port.Nodes(j).Info.UserID.Value();
-            if(!lin_found && lin_name == name){
-                nodes[lin].push_back(port.Nodes(j));
-                lin_found = true;
-            }
-            if(!rot_found && rot_name == name){
-                nodes[rot].push_back(port.Nodes(j));
-                rot_found = true;
-            }
-        }
-        if(!lin_found || !rot_found){
-            printf("Not all motors are present!\n");
-            return -1;
-        }
-    }
-
-    // Enable nodes
-    for(int i = 0; i < nodes[lin].size(); ++i){
-        nodes[lin][i].get().Status.AlertsClear();
-        nodes[lin][i].get().Motion.NodeStopClear();
-        nodes[lin][i].get().EnableReq(true);
-    }
-
-    for(int i = 0; i < nodes[rot].size(); ++i){
-        nodes[rot][i].get().Status.AlertsClear();
-        nodes[rot][i].get().Motion.NodeStopClear();
-        nodes[rot][i].get().EnableReq(true);
-    }
-
-    // Wait for enable
-    double timeout = mgr.TimeStampMsec() + 2000;
-    for(ever){
-        bool ready = true;
-        for(int i = 0; i < nodes[lin].size(); ++i){
-            if(!nodes[lin][i].get().Motion.IsReady()) ready = false;
-        }
-        for(int i = 0; i < nodes[rot].size(); ++i){
-            if(!nodes[rot][i].get().Motion.IsReady()) ready = false;
-        }
-        if(ready) break;
-        if (mgr.TimeStampMsec() > timeout) {
-            printf("Timed out waiting for Nodes to enable\n");
-            return -1;
-        }
-    }
-
-
-    // Start homing
-    for(int i = 0; i < nodes[lin].size(); ++i){
-        if(!nodes[lin][i].get().Motion.Homing.HomingValid()) continue;
-        if(!nodes[lin][i].get().Motion.Homing.WasHomed()) 
-            nodes[lin][i].get().Motion.Homing.Initiate();
-    }
-
-    // Wait for homing
-    timeout = mgr.TimeStampMsec() + homing_timeout_ms;
-    for(ever){
-        bool homed = true;
-        for(int i = 0; i < nodes[lin].size(); ++i){
-            if(!nodes[lin][i].get().Motion.Homing.HomingValid()) continue;
-            if(!nodes[lin][i].get().Motion.Homing.WasHomed()) homed = false;
-        }
-        if(homed) break;
-        
-        if(mgr.TimeStampMsec() > timeout){
-            cout << "Homing timed out" << endl;
-            close_all();
-            return -1;
-        }
-    }
-
-    // Set motion parameters
-    for(int i = 0; i < nodes[lin].size(); ++i){
-        nodes[lin][i].get().AccUnit(sFnd::INode::COUNTS_PER_SEC2);
-        nodes[lin][i].get().VelUnit(sFnd::INode::COUNTS_PER_SEC);
-        nodes[lin][i].get().Info.Ex.Parameter(98,1);
-        nodes[lin][i].get().Limits.TrqGlobal = 100;
-        set_speed_lin((rod_t)i, init_vel_lin_cm_s, init_accel_lin_cm_ss);
-        /* set_speed_lin((rod_t)i, 100, 500); */
-        /* cout << "Set linear speed for " << rod_names[i] << endl; */
-        nodes[lin][i].get().Motion.PosnMeasured.AutoRefresh(true);
-        /* move_lin(i, lin_range_cm[i]/2); */
-    }
-    for(int i = 0; i < nodes[rot].size(); ++i){
-        nodes[rot][i].get().AccUnit(sFnd::INode::COUNTS_PER_SEC2);
-        nodes[rot][i].get().VelUnit(sFnd::INode::COUNTS_PER_SEC);
-        nodes[rot][i].get().Limits.TrqGlobal = 100;
-        if(i != goalie)
-            nodes[rot][i].get().Info.Ex.Parameter(98,1);
-        nodes[rot][i].get().Motion.PosnMeasured.AutoRefresh(true);
-        /* set_speed_rot((rod_t)i, 10000, 100000); */
-        set_speed_rot((rod_t)i, init_vel_rot_deg_s, init_accel_rot_deg_ss);
-        /* move_rot(i, 0); */
-    }
-
-    return 0;
-}
-
 /******************************************************************************
  * Misc
  ******************************************************************************/
 
-bool should_terminate(){
-    fd_set set;
-    struct timeval timeout;
-
-    // Initialize the file descriptor set
-    FD_ZERO(&set);
-    FD_SET(STDIN_FILENO, &set);
-
-    // Initialize the timeout data structure
-    timeout.tv_sec = 0;  // Wait for up to 1 second
-    timeout.tv_usec = 500;
-
-    // Check if input is available
-    if (select(STDIN_FILENO + 1, &set, NULL, NULL, &timeout) > 0) {
-        string command;
-        cin >> command;
-        if (command == "q") {
-            return true;
+/**
+ * Blocks on terminal input, sets quit on "q". Runs on its own thread so the
+ * control loop never waits on stdin
+ */
+void read_commands(atomic<bool> &quit){
+    string command;
+    while(cin >> command){
+        if(command == "q"){
+            quit.store(true, memory_order_relaxed);
+            return;
         }
     }
-    return false;
 }
 
 void signal_handler(int signal) {
@@ -282,15 +100,6 @@ void signal_handler(int signal) {
     }
 }
 
-void print_status(string status, string log = "", bool erase = true){
-    // Assumes status string is always same length
-    if(erase)
-        for(char c : status)
-            if(c == '\n')
-                cout << "\033[A\33[2K\r";
-    cout << status;
-}
-
 /******************************************************************************
  * Main
  ******************************************************************************/
@@ -299,22 +108,86 @@ int main(int argc, char** argv){
     /**************************************************************************
      * Setup
      **************************************************************************/
-    bool controller = false, no_motors = false;
+    bool controller = false, no_motors = false, sim_motors = false, use_ewma = false, use_tracking = false;
+    string qtm_addr = "192.168.155.1";
+    string record_path;
+    string calibration_path = "../assets/calibration/qtm.yml";
+    double mtr_sample_hz = default_sample_hz;
+    double loop_hz = default_loop_hz;
+    bool use_rt = false, frame_ticks = false;
+    string threads_path;
+    string log_path = "foosbar.log";
+    double telemetry_hz = default_telemetry_hz;
+    int sim_ports = 1;
+    double sim_latency_ms = sim_cmd_latency_ms;
 
     for(int i = 1; i < argc; ++i){
         string cmd(argv[i]);
+        bool has_arg = i + 1 < argc;
         if(cmd == "--controller"){
             controller = true;
         } else if(cmd == "--no-motors"){
             no_motors = true;
+        } else if(cmd == "--sim-motors"){
+            // Simulated Clearpaths, runs without the hubs attached
+            sim_motors = true;
+        } else if(cmd == "--track"){
+            // Defense follows the ball in velocity mode instead of retargeting
+            use_tracking = true;
+        } else if(cmd == "--ewma"){
+            // Old EWMA estimator instead of the Kalman filter
+            use_ewma = true;
+        } else if(cmd == "--qtm" && has_arg){
+            // e.g. 127.0.0.1 for qtm_replay
+            qtm_addr = argv[++i];
+        } else if(cmd == "--record" && has_arg){
+            // Raw marker capture, can be played back with qtm_replay
+            record_path = argv[++i];
+        } else if(cmd == "--calibration" && has_arg){
+            // QTM to table transform, see assets/calibration/qtm.yml
+            calibration_path = argv[++i];
+        } else if(cmd == "--mtr-rate" && has_arg){
+            // How often every motor position is read, Hz
+            mtr_sample_hz = stod(argv[++i]);
+        } else if(cmd == "--loop-rate" && has_arg){
+            // Control loop rate, Hz
+            loop_hz = stod(argv[++i]);
+        } else if(cmd == "--frame-ticks"){
+            // Control loop ticks on every new QTM frame instead of a timer
+            frame_ticks = true;
+        } else if(cmd == "--telemetry-rate" && has_arg){
+            // How often the viewer gets a frame, Hz
+            telemetry_hz = stod(argv[++i]);
+        } else if(cmd == "--log" && has_arg){
+            // Log lines are appended here as well as shown on the dashboard
+            log_path = argv[++i];
+        } else if(cmd == "--threads" && has_arg){
+            // CPUs, scheduling and priority per thread, see assets/config/threads.yml
+            threads_path = argv[++i];
+        } else if(cmd == "--rt"){
+            // SCHED_FIFO control loop with memory locked, needs privileges
+            use_rt = true;
+        } else if(cmd == "--sim-ports" && has_arg){
+            // Spread the simulated motors over this many SC hubs
+            sim_ports = stoi(argv[++i]);
+        } else if(cmd == "--sim-latency" && has_arg){
+            // Simulated serial round trip per command, ms
+            sim_latency_ms = stod(argv[++i]);
         } else {
             cout << "Unrecognized argument: " << cmd << endl;
             return -1;
         }
     }
 
-    // For some reason first call gives garbage value
-    (void) mgr.TimeStampMsec();
+    qtm_calibration qtm_cal;
+    if(!qtm_cal.load(calibration_path)){
+        printf("Couldn't load QTM calibration from %s, using cal_offset\n", calibration_path.c_str());
+    }
+
+    // Every thread names itself and applies its part of this first thing
+    thread_topology topology;
+    if(!threads_path.empty() && !topology.load(threads_path)) return -1;
+
 
     /**************************************************************************
      * WebSocket Init
@@ -323,8 +196,9 @@ int main(int argc, char** argv){
     struct socket_data {
         /* User data */
     };
-    vector<uWS::WebSocket<false, true, socket_data>*> clients;
+    // Guards the webapp state below, telemetry goes out through the topic
     mutex ws_mutex;
+    telemetry_stats telem;
 
     // Webapp state
     double tgt_pos[num_rod_t] = {0.5, 0.5, 0.5, 0.5};
@@ -335,8 +209,11 @@ int main(int argc, char** argv){
     int ws_selection = -1;
 
     struct uWS::Loop *loop;
+    // Set once loop is, nothing is sent before
+    atomic<uWS::App*> ws_app{nullptr};
     // Thread for web socket handling
     thread uws_thread([&]() {
+        apply_thread(topology, "uws");
         loop = uWS::Loop::get();
         // C++20 acting funky and makes me specificy every field
         uWS::App app;
@@ -344,17 +221,17 @@ int main(int argc, char** argv){
             .compression = uWS::DISABLED,
             .maxPayloadLength = 16 * 1024 * 1024,
             .idleTimeout = 16,
-            .maxBackpressure = 1 * 1024 * 1024,
+            .maxBackpressure = telemetry_max_backpressure,
             .closeOnBackpressureLimit = false,
             .resetIdleTimeoutOnSend = false,
             .sendPingsAutomatically = true,
             .maxLifetime = 0,
 
             .upgrade = nullptr,
-            .open = [&clients, &ws_mutex](auto *ws) {
+            .open = [&telem](auto *ws) {
                 /* cout << "Connection! " << 9001 << endl; */
-                lock_guard<mutex> lock(ws_mutex);
-                clients.push_back(ws);
+                ws->subscribe(telemetry_topic);
+                telem.n_clients.fetch_add(1, memory_order_relaxed);
                 /* nlohmann::json params = {}; */
                 /* for(int i = 0; i < num_rod_t; ++i){ */
                 /*     params["spacing-" + rod_names[i]] = plr_gap[i]; */
@@ -380,13 +257,16 @@ int main(int argc, char** argv){
                     }
                 }
             },
+            // Over maxBackpressure, uWS skips the message for that client
+            .dropped = [&telem](auto * /*ws*/, string_view /*message*/, uWS::OpCode /*opCode*/) {
+                telem.n_dropped.fetch_add(1, memory_order_relaxed);
+            },
             .drain = [](auto * /*ws*/) {},
             .ping = [](auto * /*ws*/, string_view) {},
             .pong = [](auto * /*ws*/, string_view) {},
-            .close = [&clients, &ws_mutex](auto* ws, int /*code*/, string_view /*message*/) {
+            .close = [&telem](auto* /*ws*/, int /*code*/, string_view /*message*/) {
                 /* cout << "Client disconnected" << endl; */
-                lock_guard<mutex> lock(ws_mutex);
-                clients.erase(remove(clients.begin(), clients.end(), ws), clients.end());
+                telem.n_clients.fetch_sub(1, memory_order_relaxed);
             }
         }).listen(9001, [](auto *listen_socket) {
             if (listen_socket) {
@@ -394,6 +274,7 @@ int main(int argc, char** argv){
             }
         });
 
+        ws_app.store(&app, memory_order_release);
         app.run(); // Run the event loop
     });
 
@@ -401,21 +282,23 @@ int main(int argc, char** argv){
      * QTM Init
      **************************************************************************/
 
-    mutex qtm_mutex;
-    vector<double> ball_pos_fast = {0, 0, 0};
-    vector<double> ball_pos_slow = {0, 0, 0};
-    vector<double> ball_vel = {0, 0, 0};
-    bool ball_in_motion = false; // Crude measure of whether ball is in motion
-
-    double rod_pos[num_axis_t][num_rod_t] = {{0,0,0,0}, {0,0,0,0}};
-    double rod_in_vision[num_rod_t] = {false, false, false, false};
+    // QTM and the motors come up side by side, the control loop starts once
+    // both have produced something and prints how long each part took
+    phase_log startup;
+    atomic<bool> vision_ready{false}, mtr_ready{false};
 
-    double qtm_time = 0;
+    // Written only by the QTM thread, everyone else reads a copy
+    seqlock<vision_state> vision_snap;
+    vision_snap.publish({});
+    // Signalled after every publish, for --frame-ticks
+    frame_event new_frame;
 
-    thread qtm_thread([&qtm_mutex, &ball_pos_fast, &ball_pos_slow, &ball_vel, &rod_pos, &qtm_time, &rod_in_vision, &ball_in_motion]() {
+    thread qtm_thread([use_ewma, qtm_addr, record_path, qtm_cal, &vision_snap, &new_frame, &startup, &vision_ready, &topology]() {
+        apply_thread(topology, "qtm");
+        double t_connect = now_ms();
         CRTProtocol rtProtocol;
 
-        const char           serverAddr[] = "192.168.155.1";
+        const char          *serverAddr = qtm_addr.c_str();
         const unsigned short basePort = 22222;
         const int            majorVersion = 1;
         const int            minorVersion = 19;
@@ -436,98 +319,141 @@ int main(int argc, char** argv){
             printf("Failed streaming!\n");
             return -1;
         }
+        double t_streaming = now_ms();
+        startup.add("qtm connect", t_connect, t_streaming);
 
-        
-        deque<pair<double, vector<double>>> pos_buffer;
-        const int buf_cap = vision_fps;
-        // Higher = more noise, less latency
-        const double gamma_vel = 0.2;
-        /* const double gamma_vel = 0.05; */
-        /* const double gamma_pos = 0.05; */
-        const double gamma_pos = 0.1;
+
+        capture_writer recorder;
+        capture_frame rec_frame;
+        rec_frame.markers.reserve(64);
+        if(!record_path.empty() && !recorder.open(record_path)){
+            printf("Couldn't open %s for recording\n", record_path.c_str());
+        }
+
+        // Preallocated, so nothing is allocated per frame
+        ball_window ball_est;
+        ball_kalman ball_kf;
+        qtm_clock clk;
+        marker_assoc assoc;
+        rod_tracker rods[num_rod_t];
+        marker_batch markers;
+        vision_state vis = {};
+        auto &ball_pos_fast = vis.ball_pos_fast;
+        auto &rod_pos = vis.rod_pos;
+        auto &rod_in_vision = vis.rod_in_vision;
         for(ever){
             CRTPacket::EPacketType packetType;
             if(rtProtocol.Receive(packetType, true, 0) == CNetwork::ResponseType::success){
                 if(packetType != CRTPacket::PacketData) continue;
-                lock_guard<mutex> lock(qtm_mutex);
-                double t_start = mgr.TimeStampMsec();
+                double t_start = now_ms();
 
                 CRTPacket *rtPacket = rtProtocol.GetRTPacket();
+                uint64_t qtm_us = rtPacket->GetTimeStamp();
+                uint32_t frame_number = rtPacket->GetFrameNumber();
+                if(recorder.f){
+                    rec_frame.host_ms = t_start;
+                    rec_frame.qtm_us = qtm_us;
+                    rec_frame.frame_number = frame_number;
+                    rec_frame.markers.clear();
+                }
 
-                bool ball_seen = false;
-                for(int r = 0; r < num_rod_t; ++r)
-                    rod_in_vision[r] = false;
-                for(int m = 0; m < rtPacket->Get3DNoLabelsMarkerCount(); ++m){
-                    
-                    // Not read directly since we want doubles not floats
-                    vector<float> marker_pos = {0, 0, 0};
-                    unsigned int n;
-                    rtPacket->Get3DNoLabelsMarker(m, marker_pos[0], marker_pos[1], marker_pos[2], n);
-                    for(int i = 0; i < 3; ++i){
-                        marker_pos[i] = marker_pos[i] / 10; // convert to mm from cm
-                        marker_pos[i] -= cal_offset[i];
-                    }
-                    // Offset convention, 0 at edge of table
-                    marker_pos[0] += play_height / 2;
-
-                    if(marker_pos[2] < 2 && !ball_seen){
-                        // ball
-                        for(int i = 0; i < 3; ++i) ball_pos_fast[i] = marker_pos[i];
-                        pos_buffer.push_front({mgr.TimeStampMsec(), ball_pos_fast});
-                        ball_seen = true;
-                    } else if(marker_pos[2] > plr_height){
-                        // hat
-                        auto [side, rod] = closest_rod(marker_pos[1]);
-                        if(side != human) continue;
-                        double dy = marker_pos[1] - (-rod_coord[rod]);
-                        /* cout << marker_pos[1] << ", " << */ 
-                        rod_pos[rot][rod] = asin(clamp(dy/hat_height, -1.0, 1.0)) / deg_to_rad;
-                        rod_pos[lin][rod] = marker_pos[0] - bumper_width - plr_width / 2;
-                        rod_in_vision[rod] = true;
-                    }
-
+                // Camera timestamps, host receive times are too jittery for velocity
+                clk.update(qtm_us, frame_number, t_start);
 
-                }
-                if(!ball_seen){
-                    if(pos_buffer.size() <= 0) continue;
-                    pos_buffer.push_front({mgr.TimeStampMsec(), pos_buffer[0].second});
-                }
-                if(pos_buffer.size() < buf_cap) continue;
-                pos_buffer.pop_back();
-                // EWMA
-                double vel[3] = {0,0,0}, pos[3] = {0,0,0}, denom_vel = 0, denom_pos = 0;
-                for(int i = 0; i < pos_buffer.size()-1; ++i){
-                    double scale_vel = exp(-gamma_vel * i);
-                    double scale_pos = exp(-gamma_pos * i);
-                    denom_vel += scale_vel;
-                    denom_pos += scale_pos;
-                    for(int j = 0; j < 3; ++j){
-                        // Important: the first one seems like it should be better, but it actually isn't
-                        // Network delay is unpredictable, so sometimes timing we get it doesn't represent
-                        // timing the video was captured. This can give extraneous high spikes in velocity.
-                        // It does however rely on having a hardcoded fps which isn't ideal
-                        /* num[j] += (pos_buffer[i].second[j] - pos_buffer[i+1].second[j]) * scale */
-                        /*     / ((pos_buffer[i].first - pos_buffer[i+1].first)/1000); */
-                        vel[j] += (pos_buffer[i].second[j] - pos_buffer[i+1].second[j]) * scale_vel * vision_fps;
-                        pos[j] += pos_buffer[i].second[j] * scale_pos;
+                ball_kf.predict(clk.dt_s);
+                markers.clear();
+                for(int m = 0; m < rtPacket->Get3DNoLabelsMarkerCount(); ++m){
+                    float x, y, z;
+                    unsigned int id;
+                    rtPacket->Get3DNoLabelsMarker(m, x, y, z, id);
+                    if(recorder.f) rec_frame.markers.push_back({x, y, z, id});
+                    markers.add(x, y, z);
+                }
+                // Raw QTM mm to table cm
+                markers.transform(qtm_cal);
+
+                ball_state pred = ball_kf.estimate();
+                auto res = assoc.associate(markers,
+                        ball_kf.initialized ? pred.pos : nullptr, pred.pos_std, clk.dt_s);
+
+                double capture_ms = clk.capture_host_ms(qtm_us);
+                bool ball_seen = res.ball >= 0;
+                if(ball_seen){
+                    ball_pos_fast[0] = markers.x[res.ball];
+                    ball_pos_fast[1] = markers.y[res.ball];
+                    ball_pos_fast[2] = markers.z[res.ball];
+                    ball_kf.update(ball_pos_fast);
+                    // Keep the marker jumping around in the air out of the EWMA too
+                    if(ball_kf.unsettled()) ball_est.push(ball_kf.estimate().pos);
+                    else ball_est.push(ball_pos_fast);
+                    vis.ball_seen_ms = capture_ms;
+                } else if(ball_kf.initialized){
+                    // Occluded, keep going along the trajectory instead of
+                    // repeating the last position, which drags velocity to 0
+                    if(capture_ms - vis.ball_seen_ms > ball_max_occlusion_ms) ball_kf.hold();
+                    ball_est.push(ball_kf.estimate().pos);
+                }
+                vis.ball_predicted = !ball_seen;
+                vis.ball_airborne = ball_kf.unsettled();
+                vis.ball_height = ball_kf.ax[2].x - ball_rad;
+                for(int r = 0; r < num_rod_t; ++r) rods[r].predict(clk.dt_s);
+                for(int s = 0; s < num_side_t; ++s){
+                    for(int r = 0; r < num_rod_t; ++r){
+                        bool seen = res.hat[s][r] >= 0;
+                        if(s == human) rod_in_vision[r] = seen;
+                        else vis.bot_rod_in_vision[r] = seen;
+                        if(!seen) continue;
+                        int m = res.hat[s][r];
+                        // Bot rods face the other way, mirror so both sides share a sign convention
+                        double dy = s == human ? markers.y[m] - rod_y(s, r) : rod_y(s, r) - markers.y[m];
+                        auto &dst = s == human ? rod_pos : vis.bot_rod_pos;
+                        dst[rot][r] = asin(clamp(dy/hat_height, -1.0, 1.0)) / deg_to_rad;
+                        dst[lin][r] = markers.x[m] - bumper_width - plr_width / 2;
+                        if(s == human) rods[r].update(rod_pos[lin][r], rod_pos[rot][r]);
                     }
                 }
-
-                double max[2] = {0,-play_width/2}, min[2] = {play_height, play_width/2};
-                for(int i = 0; i < vision_fps/3; ++i){
-                    for(int j = 0; j < 2; ++j){
-                        if(pos_buffer[i].second[j] > max[j]) max[j] = pos_buffer[i].second[j];
-                        if(pos_buffer[i].second[j] < min[j]) min[j] = pos_buffer[i].second[j];
+                for(int r = 0; r < num_rod_t; ++r){
+                    for(int a = 0; a < num_axis_t; ++a) vis.rod_vel[a][r] = rods[r].vel(a);
+                    vis.rod_windup[r] = rods[r].windup;
+                }
+                if(recorder.f) recorder.write(rec_frame);
+
+                if(ball_est.ready()){
+                    // Propagate from capture to now to cover the vision latency
+                    double latency_ms = now_ms() - capture_ms;
+                    ball_state est = ball_kf.estimate(clamp(latency_ms, 0.0, 100.0) / 1000);
+                    vis.ball_confidence = ball_confidence(est);
+                    if(use_ewma){
+                        for(int j = 0; j < 3; ++j){
+                            vis.ball_vel[j] = ball_est.vel(j);
+                            vis.ball_pos_slow[j] = ball_est.pos(j);
+                            vis.ball_std[j] = 0;
+                        }
+                    } else {
+                        for(int j = 0; j < 3; ++j){
+                            vis.ball_vel[j] = est.vel[j];
+                            vis.ball_pos_slow[j] = est.pos[j];
+                            vis.ball_std[j] = est.pos_std[j];
+                        }
                     }
+                    vis.ball_in_motion = ball_est.in_motion();
+                }
+                vis.capture_ms = capture_ms;
+                vis.fps = clk.fps;
+                vis.n_dropped = clk.n_dropped;
+                vis.delay_p50_ms = clk.delay_hist.percentile(0.5);
+                vis.delay_p99_ms = clk.delay_hist.percentile(0.99);
+                vis.assoc_p99_us = assoc.cost_hist.percentile(0.99);
+                vis.assoc_max_us = assoc.cost_hist.max_val;
+                vis.n_ball_rejected = assoc.n_ball_rejected;
+                vis.qtm_time = now_ms() - t_start;
+                vis.publish_ms = now_ms();
+                vision_snap.publish(vis);
+                new_frame.notify();
+                if(!vision_ready.load(memory_order_relaxed)){
+                    startup.add("qtm first frame", t_streaming, now_ms());
+                    vision_ready.store(true, memory_order_release);
                 }
-                ball_in_motion = max[0] - min[0] > 1 || max[1] - min[1] > 1;
-                /* cout << max[0] - min[0] << ", "  << max[1] - min[1] << endl; */
-
-                for(int j = 0; j < 3; ++j){
-                    ball_vel[j] = vel[j] / denom_vel;
-                    ball_pos_slow[j] = pos[j] / denom_pos;
-                }
-                qtm_time = mgr.TimeStampMsec() - t_start;
             }
         }
     });
@@ -537,120 +463,250 @@ int main(int argc, char** argv){
      **************************************************************************/
 
     // Do this on the main thread just to make sure that everything is initialized
-    mutex mtr_mutex;
-
     const struct motor_cmd null_cmd = {NAN, NAN, NAN};
 
-    // Could be fancier with some kind of a priority queue, but I think this is fine
-    vector<motor_cmd> mtr_cmds[num_axis_t];
-    queue<function<void(void)>> mtr_fns;
-
-    vector<double> mtr_t_last_update[num_axis_t];
-    vector<double> mtr_t_last_cmd[num_axis_t];
-
-    vector<motor_cmd> mtr_last_cmd[num_axis_t];
-
+    // Control loop posts commands, motor thread publishes what it did with them
     bool disable_motor_updates = false;
 
-    vector<double> cur_pos[num_axis_t];
-
+    motor_cmds init_cmds;
+    motor_state init_mtr;
     for(int a = 0; a < num_axis_t; ++a){
         for(int r = 0; r < num_rod_t; ++r){
-            mtr_cmds[a].push_back(null_cmd);
-            mtr_t_last_update[a].push_back(mgr.TimeStampMsec());
-            mtr_t_last_cmd[a].push_back(mgr.TimeStampMsec());
+            init_cmds.cmd[a][r] = null_cmd;
+            init_mtr.t_last_cmd[a][r] = now_ms();
+            init_mtr.n_moves[a][r] = 0;
+            axis_profile &prof = init_mtr.profile[a][r];
+            prof.t_ms = now_ms();
+            prof.tz.vmax = a == lin ? init_vel_lin_cm_s : init_vel_rot_deg_s;
+            prof.tz.amax = a == lin ? init_accel_lin_cm_ss : init_accel_rot_deg_ss;
             if(a == rot){
-                mtr_last_cmd[a].push_back({0, init_vel_lin_cm_s, init_accel_lin_cm_ss});
-                cur_pos[a].push_back(lin_range_cm[r]/2);
+                init_mtr.last_cmd[a][r] = {0, init_vel_lin_cm_s, init_accel_lin_cm_ss};
+                init_mtr.cur_pos[a][r] = lin_range_cm[r]/2;
             }
             else{
-                mtr_last_cmd[a].push_back({0, init_vel_rot_deg_s, init_accel_rot_deg_ss});
-                cur_pos[a].push_back(0);
+                init_mtr.last_cmd[a][r] = {0, init_vel_rot_deg_s, init_accel_rot_deg_ss};
+                init_mtr.cur_pos[a][r] = 0;
                 /* move_lin(r, 0); */
             }
         }
     }
-
-    if(!no_motors){
-        int init_err = motors_init();
+    motor_dispatcher mtr_dispatch(init_cmds);
+    seqlock<motor_state> mtr_snap;
+    mtr_snap.publish(init_mtr);
+
+    unique_ptr<motor_backend> motors;
+    if(sim_motors){
+        motors.reset(new sim_backend(sim_ports, sim_latency_ms));
+    } else if(!no_motors){
+#ifdef HAVE_SFOUNDATION
+        motors.reset(make_sfnd_backend());
+#else
+        printf("Built without sFoundation, use --sim-motors or --no-motors\n");
+        return -1;
+#endif
+    }
+    if(motors){
+        double t_init = now_ms();
+        int init_err = motors->init(startup);
         if(init_err < 0) return init_err;
-
+        startup.add("motor init", t_init, now_ms());
     }
 
-    // This is the only thread that should ever query motors directly
-    thread mtr_thread([no_motors, &mtr_mutex, &mtr_cmds, &mtr_t_last_update, &mtr_t_last_cmd, &mtr_last_cmd, &cur_pos, &disable_motor_updates, &mtr_fns]() {
-        if(no_motors) return;
+    sample_stats mtr_sampling;
+    motor_events mtr_events;
 
-        const double mtr_refresh_t_ms = 100;
+    // This is the only thread that should ever query motors directly, the
+    // port workers it hands calls to are just its extra hands on the wire
+    thread mtr_thread([&motors, init_mtr, mtr_sample_hz, &mtr_dispatch, &mtr_snap, &mtr_sampling, &mtr_events, &disable_motor_updates, &startup, &mtr_ready, &topology]() {
+        if(!motors) return;
+        apply_thread(topology, "motor");
+        double t_first = now_ms();
 
-        auto exec_cmds = [&](){
-            while(mtr_fns.size() > 0){
-                mtr_fns.front()();
-                mtr_fns.pop();
-            }
+        const double mtr_sample_t_ms = 1000 / mtr_sample_hz;
+
+        port_pool ports(motors.get(), [&topology](int p){ apply_thread(topology, "port", p); });
+        motor_io ios[max_motor_ops];
+        motion_monitor monitor;
+
+        // Only this thread writes these, control loop sees them through mtr_snap
+        motor_state mtr = init_mtr;
+        auto &cur_pos = mtr.cur_pos;
+        auto &mtr_last_cmd = mtr.last_cmd;
+        auto &mtr_t_last_cmd = mtr.t_last_cmd;
+
+        auto query = [](int a, int r){
+            motor_io io;
+            io.op = {op_query, a, r, NAN, NAN, {}};
+            return io;
+        };
+
+        // Read result into cur_pos, the history and the profile. The sample
+        // is timestamped halfway through the read
+        auto record = [&](const motor_io &io){
+            int a = io.op.axis, r = io.op.rod;
+            double t = (io.t_start + io.t_end) / 2;
+            cur_pos[a][r] = io.pos;
+            mtr.history[a][r].add(t, io.pos);
+            mtr.profile[a][r].measured(t, io.pos);
+            mtr_sampling.read_hist.add((io.t_end - io.t_start) * 1000);
+
+            motor_event evts[num_motor_evt_t];
+            int n_evts = monitor.check(a, r, mtr, evts);
+            for(int i = 0; i < n_evts; ++i) mtr_events.push(evts[i]);
+        };
+
+        // Sweeps go in rounds of one axis per port, so every port is busy
+        // each round and commands can get in between rounds
+        int n_rounds = 0;
+        motor_io rounds[num_motors][max_motor_ports];
+        int round_size[num_motors] = {};
+        {
+            int per_port[max_motor_ports] = {};
             for(int a = 0; a < num_axis_t; ++a){
                 for(int r = 0; r < num_rod_t; ++r){
-                    // Awkward to make sure thread safe
-                    vector<function<void(void)>> moves;
-                    {
-                        lock_guard<mutex> lock(mtr_mutex);
-                        motor_cmd cmd = mtr_cmds[a][r];
-                        motor_cmd last_cmd = mtr_last_cmd[a][r];
-
-                        if((!isnan(cmd.vel) && abs(cmd.vel - last_cmd.vel) > eps)
-                                || (!isnan(cmd.accel) && abs(cmd.accel - last_cmd.accel) > eps)){
-                            moves.push_back([a, r, cmd](){
-                                mtr_set_speed[a](r, cmd.vel, cmd.accel);
-                            });
-                            if(!isnan(cmd.vel))
-                                mtr_last_cmd[a][r].vel = cmd.vel;
-                            if(!isnan(cmd.accel))
-                                mtr_last_cmd[a][r].accel = cmd.accel;
-                            mtr_t_last_cmd[a][r] = mgr.TimeStampMsec();
-                        }
+                    int k = per_port[ports.n_ports == 1 ? 0 : motors->port(a, r)]++;
+                    rounds[k][round_size[k]++] = query(a, r);
+                    n_rounds = max(n_rounds, k + 1);
+                }
+            }
+        }
 
-                        if(!isnan(cmd.pos) && abs(cmd.pos - last_cmd.pos) > eps){
-                            moves.push_back([a, r, cmd](){
-                                mtr_move[a](r, cmd.pos);
-                            });
-                            mtr_last_cmd[a][r].pos = cmd.pos;
-                            mtr_t_last_cmd[a][r] = mgr.TimeStampMsec();
-                        }
-                    }
-                    // This is outside the lock's scope to avoid holding mutex too long
-                    for(auto fn : moves){
-
-                        try{
-                            fn();
-                        } catch (sFnd::mnErr& theErr)
-                        {
-                            printf("Caught mnErr\n");
-                            printf("Caught error: addr=%d, err=0x%08x\nmsg=%s\n", theErr.TheAddr, theErr.ErrorCode, theErr.ErrorMsg);
-                            cout << endl << endl << endl << endl << endl << endl;
-                        }
-                    }
+        // Profiles start out holding wherever the motors are
+        for(int k = 0; k < n_rounds; ++k){
+            ports.run(rounds[k], round_size[k]);
+            for(int i = 0; i < round_size[k]; ++i){
+                const motor_io &io = rounds[k][i];
+                if(!io.ok){
+                    printf("Caught motor error: %s\n", io.err.c_str());
+                    continue;
+                }
+                record(io);
+                mtr.profile[io.op.axis][io.op.rod].tz.target = io.pos;
+            }
+        }
+        mtr_snap.publish(mtr);
+        startup.add("first motor sweep", t_first, now_ms());
+        mtr_ready.store(true, memory_order_release);
+
+        motor_op ops[max_motor_ops];
+
+        auto exec_ops = [&](int n_ops){
+            bool changed = false;
+            int n_ios = 0;
+            for(int i = 0; i < n_ops; ++i){
+                motor_op op = ops[i];
+                int a = op.axis, r = op.rod;
+                motor_cmd &last_cmd = mtr_last_cmd[a][r];
+                switch(op.type){
+                case op_speed:
+                    if((isnan(op.a) || abs(op.a - last_cmd.vel) <= eps)
+                            && (isnan(op.b) || abs(op.b - last_cmd.accel) <= eps)) continue;
+                    if(!isnan(op.a)) last_cmd.vel = op.a;
+                    if(!isnan(op.b)) last_cmd.accel = op.b;
+                    op.a = last_cmd.vel;
+                    op.b = last_cmd.accel;
+                    mtr_t_last_cmd[a][r] = now_ms();
+                    break;
+                case op_move:
+                    // Coming out of velocity mode it has to be sent regardless
+                    if(!mtr.profile[a][r].tz.vel_mode && abs(op.a - last_cmd.pos) <= eps) continue;
+                    last_cmd.pos = op.a;
+                    last_cmd.track_vel = NAN;
+                    mtr_t_last_cmd[a][r] = now_ms();
+                    break;
+                case op_vel:
+                    if(abs(op.a - last_cmd.track_vel) <= eps) continue;
+                    last_cmd.track_vel = op.a;
+                    mtr_t_last_cmd[a][r] = now_ms();
+                    break;
+                default:
+                    break;
+                }
+                mtr_dispatch.issued(op);
+                ios[n_ios++].op = op;
+            }
+            if(n_ios == 0) return;
+
+            ports.run(ios, n_ios);
+
+            for(int i = 0; i < n_ios; ++i){
+                const motor_io &io = ios[i];
+                const motor_op &op = io.op;
+                int a = op.axis, r = op.rod;
+                changed = true;
+                if(!io.ok){
+                    printf("Caught motor error: %s\n", io.err.c_str());
+                    cout << endl << endl << endl << endl << endl << endl;
+                    continue;
+                }
+                switch(op.type){
+                case op_speed:
+                    mtr.profile[a][r].limits(io.t_end, op.a, op.b);
+                    break;
+                case op_move:
+                    // Same clamp as the motor applies
+                    mtr.profile[a][r].move(io.t_end, a == lin ? clamp(op.a, 0.0, lin_range_cm[r]) : op.a);
+                    monitor.moved(a, r, mtr.profile[a][r], op.a, ++mtr.n_moves[a][r]);
+                    break;
+                case op_vel:
+                    mtr.profile[a][r].move_vel(io.t_end, op.a);
+                    monitor.idle(a, r);
+                    break;
+                case op_stop:
+                    mtr.profile[a][r].stop(io.t_end);
+                    monitor.idle(a, r);
+                    break;
+                case op_query:
+                    record(io);
+                    break;
+                default:
+                    break;
                 }
             }
+            if(changed) mtr_snap.publish(mtr);
         };
-        for(ever){
+        // Nothing on the drive stops a velocity move short of the end stops,
+        // so if the control loop stalls stop them here
+        auto vel_watchdog = [&](){
+            if(now_ms() - mtr_dispatch.t_last_post.load(memory_order_relaxed) < vel_watchdog_ms) return;
+            int n_stops = 0;
             for(int a = 0; a < num_axis_t; ++a){
                 for(int r = 0; r < num_rod_t; ++r){
-                    exec_cmds();
-                    if(mgr.TimeStampMsec() - mtr_t_last_update[a][r] > mtr_refresh_t_ms && !disable_motor_updates){
-                        lock_guard<mutex> lock(mtr_mutex);
-                        if(a == lin){
-                            cur_pos[a][r] = abs(nodes[lin][r].get().Motion.PosnMeasured.Value()
-                                    / lin_cm_to_cnts[r]);
-                        } else {
-                            cur_pos[a][r] = nodes[rot][r].get().Motion.PosnMeasured.Value()
-                                    / rot_rad_to_cnts[r] / deg_to_rad + cal_rot;
-                        }
-                        mtr_t_last_update[a][r] = mgr.TimeStampMsec();
-                    } else {
-                        this_thread::sleep_for(chrono::microseconds(100));
-                    }
+                    double vel = mtr_last_cmd[a][r].track_vel;
+                    if(!isnan(vel) && vel != 0) ops[n_stops++] = {op_vel, a, r, 0, NAN, chrono::steady_clock::now()};
                 }
             }
+            if(n_stops == 0) return;
+            mtr_dispatch.n_vel_timeouts.fetch_add(1, memory_order_relaxed);
+            exec_ops(n_stops);
+        };
+        // Every sample period read all axes in one sweep, sleeping on the
+        // dispatcher in between so commands still go out right away
+        double t_next_sweep = now_ms();
+        for(ever){
+            exec_ops(mtr_dispatch.wait(ops, t_next_sweep - now_ms()));
+            vel_watchdog();
+            if(now_ms() < t_next_sweep) continue;
+
+            double t_sweep = now_ms();
+            // Fixed schedule, but don't try to catch up on missed sweeps
+            t_next_sweep = max(t_next_sweep + mtr_sample_t_ms, t_sweep);
+            if(disable_motor_updates) continue;
+            for(int k = 0; k < n_rounds; ++k){
+                ports.run(rounds[k], round_size[k]);
+                for(int i = 0; i < round_size[k]; ++i){
+                    if(rounds[k][i].ok) record(rounds[k][i]);
+                    else printf("Caught motor error: %s\n", rounds[k][i].err.c_str());
+                }
+                // Commands take priority over samples
+                exec_ops(mtr_dispatch.wait(ops, 0));
+            }
+            mtr_snap.publish(mtr);
+
+            double sweep_ms = now_ms() - t_sweep;
+            mtr_sampling.sweep_hist.add(sweep_ms * 1000);
+            mtr_sampling.n_sweeps.fetch_add(1, memory_order_relaxed);
+            if(sweep_ms > mtr_sample_t_ms) mtr_sampling.n_overruns.fetch_add(1, memory_order_relaxed);
         }
     });
 
@@ -658,9 +714,24 @@ int main(int argc, char** argv){
      * Main Event Loop
      **************************************************************************/
 
-    cout << endl << endl << endl << endl << endl << endl;
-    cout << fixed << setprecision(2);
-    
+    // Wait for real motor positions and a first frame rather than a fixed
+    // sleep. Carries on without them after a while, e.g. QTM not running
+    {
+        double t_wait = now_ms();
+        bool waiting_mtr = (bool)motors, waiting_vis = true;
+        while(waiting_mtr || waiting_vis){
+            if(waiting_mtr && mtr_ready.load(memory_order_acquire)) waiting_mtr = false;
+            if(waiting_vis && vision_ready.load(memory_order_acquire)) waiting_vis = false;
+            if(now_ms() - t_wait > startup_wait_ms){
+                if(waiting_mtr) printf("No motor samples after %.0fms, starting anyway\n", startup_wait_ms);
+                if(waiting_vis) printf("No QTM frame after %.0fms, starting anyway\n", startup_wait_ms);
+                break;
+            }
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        startup.print();
+    }
+
     /* state_t state = state_unknown; */
     /* state_t state = state_controlled_move; */
     /* state_t state = state_uncontrolled; */
@@ -671,7 +742,7 @@ int main(int argc, char** argv){
     c5b_t c5b_task = c5b_init;
     cmove_t cmove_task = cmove_init;
     csnake_t csnake_task = csnake_init;
-    double control_task_timer = mgr.TimeStampMsec();
+    double control_task_timer = now_ms();
 
     // Shot variables
     // 1 = right, -1 = left, 0 = not shooting
@@ -690,82 +761,303 @@ int main(int argc, char** argv){
     int cmove_end_side = 1;
 
     /* for(int i = 0; i < 2; ++i){ */
-    /*     double start_t = mgr.TimeStampMsec(); */
+    /*     double start_t = now_ms(); */
     /*     move_rot(i, 90); */
-    /*     cout << mgr.TimeStampMsec() - start_t << endl; */
+    /*     cout << now_ms() - start_t << endl; */
     /* } */
 
-    // So that motor cur_pos is updated by the first loop
-    this_thread::sleep_for(chrono::microseconds(200000));
-    double time_ms = mgr.TimeStampMsec();
+    double time_ms = now_ms();
 
-    for(ever){
+    // Per tick copies of the shared state, nothing is locked while the state machine runs
+    vision_state vis;
+    motor_state mtr;
+    motor_cmds cmds_out = init_cmds;
+    vector<double> ball_pos_fast = {0, 0, 0};
+    vector<double> ball_pos_slow = {0, 0, 0};
+    vector<double> ball_vel = {0, 0, 0};
+    vector<double> ball_std = {0, 0, 0};
+    bool ball_in_motion = false;
+    // How long ago the ball was actually seen
+    double ball_seen_ago_ms = 0;
+    // Human rods as measured, and where they'll be by the time a shot of ours
+    // gets there. Blocking checks for our shots and passes use the look-ahead
+    auto &rod_pos = vis.rod_pos;
+    double rod_pos_ahead[num_axis_t][num_rod_t];
+    auto &cur_pos = mtr.cur_pos;
+    auto &mtr_last_cmd = mtr.last_cmd;
+    auto &mtr_t_last_cmd = mtr.t_last_cmd;
+    auto &mtr_cmds = cmds_out.cmd;
+    // Where an axis should be right now going by its motion profile. cur_pos
+    // can be up to a refresh period old
+    auto mtr_pos = [&](int a, int r){ return motor_pos_at(mtr, a, r, time_ms); };
+
+    // Follow target on a linear axis in velocity mode, see --track. A rod
+    // that isn't tracked in a tick goes back to a position move to its last
+    // target, so nothing is ever left running
+    bool tracked[num_rod_t] = {};
+    double t_last_track[num_rod_t] = {};
+    histogram<200> track_err_hist(0.05); // cm
+    auto track_lin = [&](int rod, double target, double target_vel, double vmax, double accel){
+        motor_cmd &cmd = mtr_cmds[lin][rod];
+        target = clamp(target, 0.0, lin_range_cm[rod]);
+        track_err_hist.add(abs(target - cur_pos[lin][rod]));
+        tracked[rod] = true;
+        bool tracking = !isnan(cmd.track_vel);
+        cmd.pos = target;
+        cmd.vel = vmax;
+        cmd.accel = accel;
+        if(tracking && time_ms - t_last_track[rod] < track_period_ms) return;
+        cmd.track_vel = track_vel(target, target_vel, mtr_pos(lin, rod), mtr.profile[lin][rod].vel_at(time_ms),
+                vmax, accel, 0, lin_range_cm[rod]);
+        t_last_track[rod] = time_ms;
+    };
+    // Both axes of rod to target at t_ms (NAN for as soon as possible), see
+    // plan_coord_move. The plan says when they'll get there and whether
+    // that's when it was asked for
+    auto coord_move = [&](int rod, const double target[num_axis_t], double t_ms, const double vmax[num_axis_t], const double amax[num_axis_t]){
+        coord_plan plan = plan_coord_move(mtr, rod, target, t_ms, time_ms, vmax, amax);
+        for(int a = 0; a < num_axis_t; ++a) mtr_cmds[a][rod] = plan.cmd[a];
+        return plan;
+    };
+    // Latest move each axis finished, from the motor thread's events
+    long done_move[num_axis_t][num_rod_t] = {};
+    // The last move asked for has gone out and finished. Fine to call in the
+    // same tick the command is set, it won't have been sent yet
+    auto mtr_done = [&](int a, int r){
+        double want = mtr_cmds[a][r].pos;
+        if(!isnan(want) && abs(want - mtr_last_cmd[a][r].pos) > eps) return false;
+        return done_move[a][r] >= mtr.n_moves[a][r];
+    };
+    double t_telemetry = 0;
+    uint32_t n_telemetry = 0;
+    // Publish of a frame to the commands from the first tick that saw it
+    // going out, and ticks that had no new frame to work with
+    histogram<200> frame_cmd_hist(10); // us
+    double last_frame_ms = 0;
+    atomic<long> n_stale_ticks{0};
+
+    // The tick never formats or prints anything. Log lines go through
+    // tick_log and what the dashboard shows through ctrl_snap, the status
+    // thread does the rest
+    event_log tick_log;
+    control_status ctrl_out = {};
+    seqlock<control_status> ctrl_snap;
+    ctrl_snap.publish(ctrl_out);
+
+    // Terminal input is read on its own thread, the loop just checks the flag
+    atomic<bool> quit{false};
+    thread input_thread([&quit, &topology](){
+        apply_thread(topology, "input");
+        read_commands(quit);
+    });
+    input_thread.detach();
+
+    // With --frame-ticks the rate is only the fallback when no frames come
+    rate_loop ctrl_loop(frame_ticks ? 1000 / frame_fallback_ms : loop_hz);
+    const loop_stats &loop_st = ctrl_loop.stats;
+
+    FILE *log_file = fopen(log_path.c_str(), "a");
+    if(!log_file) printf("Couldn't open log %s\n", log_path.c_str());
+
+    // Terminal dashboard and log file, at a human rate. Only reads snapshots
+    // and stats, never the control loop's own state
+    thread status_thread([&](){
+        apply_thread(topology, "status");
+        double t_origin = now_ms();
+        int prev_lines = 0;
+        long n_vel_last = 0;
+        double t_vel_rate = t_origin, vel_cmd_rate = 0;
+        vector<thread_stats> thread_st;
+        double t_thread_report = 0;
+        long n_frames_last = 0, n_bytes_last = 0;
+        double t_telem_rate = t_origin, telem_fps = 0, telem_bps = 0;
+        string out;
+        char line[512];
+        while(!quit.load(memory_order_relaxed)){
+            this_thread::sleep_for(chrono::duration<double, milli>(status_period_ms));
+            double now = now_ms();
+            vision_state vis = vision_snap.read();
+            motor_state mtr = mtr_snap.read();
+            control_status ctrl = ctrl_snap.read();
+            const double *ball_pos_fast = vis.ball_pos_fast, *ball_pos_slow = vis.ball_pos_slow, *ball_vel = vis.ball_vel;
+            auto &rod_pos = ctrl.rod_pos;
+            auto &cur_pos = mtr.cur_pos;
+
+            // Back over the last dashboard, new log lines go above the next one
+            out.clear();
+            if(prev_lines > 0) out += "\033[" + to_string(prev_lines) + "A\033[J";
+            for(log_record rec; tick_log.pop(rec);){
+                format_record(rec, line, sizeof(line));
+                if(log_file) fprintf(log_file, "%10.1f %s\n", rec.t_ms - t_origin, line);
+                out += line;
+                out += '\n';
+            }
+            if(log_file) fflush(log_file);
+
+            stringstream status;
+            status << fixed << setprecision(3) << setw(10) << showpos;
+            status << "Ball position fast: " << ball_pos_fast[0] << ", " << ball_pos_fast[1] << ", " << ball_pos_fast[2] << "; " << endl;;
+            status << "Ball position slow: " << ball_pos_slow[0] << ", " << ball_pos_slow[1] << ", " << ball_pos_slow[2] << "; ";
+            status << "Ball velocity: " << ball_vel[0] << ", " << ball_vel[1] << ", " << ball_vel[2] << endl;
+            status << "Ball seen: " << now - vis.ball_seen_ms << "ms ago, confidence " << vis.ball_confidence << (vis.ball_predicted ? " (predicted)" : "")
+                << ", height " << vis.ball_height << (vis.ball_airborne ? " (airborne)" : "") << endl;
+            status << "Marker positions: " << rod_pos[lin][three_bar] << ", " << rod_pos[lin][five_bar] << ", " << rod_pos[lin][two_bar] << ", " << rod_pos[lin][goalie] << "; ";
+            status << "Marker rotations: " << rod_pos[rot][three_bar] << ", " << rod_pos[rot][five_bar] << ", " << rod_pos[rot][two_bar] << ", " << rod_pos[rot][goalie] << endl;
+            status << "Rod velocities: " << vis.rod_vel[lin][three_bar] << ", " << vis.rod_vel[lin][five_bar] << ", " << vis.rod_vel[lin][two_bar] << ", " << vis.rod_vel[lin][goalie] << "; ";
+            status << "Wind-up: " << vis.rod_windup[three_bar] << vis.rod_windup[five_bar] << vis.rod_windup[two_bar] << vis.rod_windup[goalie] << endl;
+            status << "State: " << ctrl.state << endl;
+            status << "Cmove task: " << ctrl.cmove_task << endl;
+            status << "Debug: " << ctrl.debug[0] << ", " << ctrl.debug[1] << ", " << ctrl.debug[2] << endl;
+            status << "Three bar pos: " << cur_pos[lin][three_bar] << ", rot: " << cur_pos[rot][three_bar]
+                << ", predicted: " << motor_pos_at(mtr, lin, three_bar, now) << ", " << motor_pos_at(mtr, rot, three_bar, now)
+                << ", read error: " << mtr.profile[lin][three_bar].err << ", " << mtr.profile[rot][three_bar].err << endl;
+            status << "Blocked: " << is_blocked(five_bar, 12, rod_pos, 0, three_bar) << endl;
+            status << "QTM fps: " << vis.fps << ", dropped: " << vis.n_dropped
+                << ", capture to now: " << now - vis.capture_ms << "ms"
+                << ", delay jitter p50/p99: " << vis.delay_p50_ms << "/" << vis.delay_p99_ms << "ms" << endl;
+            status << "Marker association p99/max: " << vis.assoc_p99_us << "/" << vis.assoc_max_us
+                << "us, ball candidates rejected: " << vis.n_ball_rejected << endl;
+            status << "Snapshot retries: vision " << vision_snap.n_retries << "/" << vision_snap.n_reads
+                << ", motor " << mtr_snap.n_retries << "/" << mtr_snap.n_reads << endl;
+            status << "Motor command latency p50/p99/max: " << mtr_dispatch.latency_hist.percentile(0.5)
+                << "/" << mtr_dispatch.latency_hist.percentile(0.99) << "/" << mtr_dispatch.latency_hist.max_val
+                << "us, ops " << mtr_dispatch.n_ops << ", coalesced " << mtr_dispatch.n_coalesced
+                << ", overflows " << mtr_dispatch.n_overflows << ", wakeups " << mtr_dispatch.n_wakeups
+                << ", velocity watchdog stops " << mtr_dispatch.n_vel_timeouts << endl;
+            double min_rate = INFINITY;
+            for(int a = 0; a < num_axis_t; ++a)
+                for(int r = 0; r < num_rod_t; ++r)
+                    min_rate = min(min_rate, mtr.history[a][r].rate_hz());
+            status << "Motor sampling: " << min_rate << "Hz slowest axis, read p50/p99: " << mtr_sampling.read_hist.percentile(0.5)
+                << "/" << mtr_sampling.read_hist.percentile(0.99) << "us, sweep p99: " << mtr_sampling.sweep_hist.percentile(0.99)
+                << "us, overruns " << mtr_sampling.n_overruns << "/" << mtr_sampling.n_sweeps
+                << ", ports " << (motors ? motors->num_ports() : 0) << endl;
+            if(now - t_vel_rate >= 1000){
+                long n_vel = mtr_dispatch.n_issued[op_vel];
+                vel_cmd_rate = (n_vel - n_vel_last) * 1000 / (now - t_vel_rate);
+                n_vel_last = n_vel;
+                t_vel_rate = now;
+            }
+            status << "Motor events done/follow error/stall: " << mtr_events.n_events[evt_done] << "/"
+                << mtr_events.n_events[evt_follow_err] << "/" << mtr_events.n_events[evt_stall]
+                << ", latency p50/p99: " << mtr_events.latency_hist.percentile(0.5) << "/" << mtr_events.latency_hist.percentile(0.99)
+                << "us, dropped " << mtr_events.n_dropped << endl;
+            status << "Control loop: ";
+            if(frame_ticks) status << "on frames";
+            else status << loop_hz << "Hz";
+            status << (use_rt ? " (rt)" : "") << ", wake jitter p50/p99/max: "
+                << loop_st.jitter_hist.percentile(0.5) << "/" << loop_st.jitter_hist.percentile(0.99) << "/" << loop_st.jitter_hist.max_val
+                << "us, tick p99/max: " << loop_st.tick_hist.percentile(0.99) << "/" << loop_st.tick_hist.max_val
+                << "us, overruns " << loop_st.n_overruns << "/" << loop_st.n_ticks << ", skipped " << loop_st.n_skipped << endl;
+            status << "Frame to command p50/p99/max: " << frame_cmd_hist.percentile(0.5) << "/" << frame_cmd_hist.percentile(0.99)
+                << "/" << frame_cmd_hist.max_val << "us, ticks without a new frame " << n_stale_ticks;
+            if(frame_ticks){
+                status << ", frame/timer ticks " << loop_st.n_frame_ticks << "/" << loop_st.n_timer_ticks
+                    << ", frames merged " << loop_st.n_frames_merged;
+            }
+            status << endl;
+            // Reads /proc, so only once a second
+            if(now - t_thread_report >= 1000){
+                thread_st = thread_report();
+                t_thread_report = now;
+            }
+            status << "Threads (cpu, switches vol/invol, migrations):";
+            for(const thread_stats &st : thread_st){
+                status << " " << st.name.substr(3) << " " << st.cpu << " " << st.n_voluntary << "/" << st.n_involuntary << " " << st.n_migrations << ";";
+            }
+            status << endl;
+            status << "Tracking " << (use_tracking ? "on" : "off") << ", error p50/p99: " << track_err_hist.percentile(0.5)
+                << "/" << track_err_hist.percentile(0.99) << "cm, velocity commands " << vel_cmd_rate << "/s" << endl;
+            if(now - t_telem_rate >= 1000){
+                long n_frames = telem.n_frames, n_bytes = telem.n_bytes;
+                telem_fps = (n_frames - n_frames_last) * 1000 / (now - t_telem_rate);
+                telem_bps = (n_bytes - n_bytes_last) * 1000 / (now - t_telem_rate);
+                n_frames_last = n_frames;
+                n_bytes_last = n_bytes;
+                t_telem_rate = now;
+            }
+            status << "Telemetry: " << telem.n_clients << " clients, " << telem_fps << " frames/s, " << telem_bps / 1000
+                << "kB/s, build p99 " << telem.build_hist.percentile(0.99) << "us, publish p50/p99: " << telem.publish_hist.percentile(0.5)
+                << "/" << telem.publish_hist.percentile(0.99) << "us, dropped for backpressure " << telem.n_dropped << endl;
+            status << "Log lines dropped: " << tick_log.n_dropped << endl;
+
+            string dash = status.str();
+            prev_lines = count(dash.begin(), dash.end(), '\n');
+            out += dash;
+            fwrite(out.data(), 1, out.size(), stdout);
+            fflush(stdout);
+        }
+    });
 
-        if(should_terminate()) break;
+    // Every other thread is started by now, so none of them inherit FIFO.
+    // A control entry in the thread config takes over from --rt's default
+    if(use_rt) lock_memory();
+    apply_thread(topology, "control");
+    const thread_config *control_cfg = topology.get("control");
+    if(use_rt && !(control_cfg && control_cfg->set_sched)) set_fifo(default_rt_priority);
 
-        double start_t = mgr.TimeStampMsec();
+    ctrl_loop.start();
 
-        stringstream status;
-        stringstream log;
+    for(ever){
 
-        lock_guard<mutex> qtm_lock(qtm_mutex);
-        lock_guard<mutex> mtr_lock(mtr_mutex);
+        if(quit.load(memory_order_relaxed)) break;
 
-        
+        double start_t = now_ms();
 
-        json positionData = {
-            {"type", "pos"},
-            {"bluepos", {
-                0.5, 0.5, 0.5, 0.5
-            }},
-            {"redpos", {
-                cur_pos[lin][three_bar] / lin_range_cm[three_bar],
-                cur_pos[lin][five_bar] / lin_range_cm[five_bar],
-                cur_pos[lin][two_bar] / lin_range_cm[two_bar],
-                cur_pos[lin][goalie] / lin_range_cm[goalie],
-            }},
-            {"bluerot", {
-                0,0,0,0
-            }},
-            {"redrot", {
-                cur_pos[rot][three_bar],
-                cur_pos[rot][five_bar],
-                cur_pos[rot][two_bar],
-                cur_pos[rot][goalie],
-            }},
-            {"ballpos", {
-                ball_pos_fast[0]/(play_height),
-                ball_pos_fast[1]/(play_width),
-                0,
-            }}
-        };
-        status << fixed << setprecision(3) << setw(10) << showpos;
-        status << "Ball position fast: " << ball_pos_fast[0] << ", " << ball_pos_fast[1] << ", " << ball_pos_fast[2] << "; " << endl;;
-        status << "Ball position slow: " << ball_pos_slow[0] << ", " << ball_pos_slow[1] << ", " << ball_pos_slow[2] << "; ";
-        status << "Ball velocity: " << ball_vel[0] << ", " << ball_vel[1] << ", " << ball_vel[2] << endl;
-        status << "Marker positions: " << rod_pos[lin][three_bar] << ", " << rod_pos[lin][five_bar] << ", " << rod_pos[lin][two_bar] << ", " << rod_pos[lin][goalie] << "; ";
-        status << "Marker rotations: " << rod_pos[rot][three_bar] << ", " << rod_pos[rot][five_bar] << ", " << rod_pos[rot][two_bar] << ", " << rod_pos[rot][goalie] << endl;
-        status << "State: " << state << endl;
-        status << "Cmove task: " << cmove_task << endl;
-        status << "Three bar pos: " << cur_pos[lin][three_bar] << ", rot: " << cur_pos[rot][three_bar] << endl;
-        status << "Blocked: " << is_blocked(five_bar, 12, rod_pos, 0, three_bar) << endl;
-
-        /* static int frame = 0; */
-        /* status << "Frame: " << ++frame << endl; */
-        /* status << "QTM time: " << qtm_time << endl; */
-        string message = positionData.dump();
+        for(double &d : ctrl_out.debug) d = NAN;
 
-        {
-            lock_guard<mutex> lock(ws_mutex);
-            for (auto* client : clients) {
-                loop->defer([client, message](){
-                    client->send(message, uWS::OpCode::TEXT);
-                });
+        vis = vision_snap.read();
+        mtr = mtr_snap.read();
+        for(int r = 0; r < num_rod_t; ++r) tracked[r] = false;
+        for(motor_event evt; mtr_events.pop(evt, start_t);){
+            if(evt.type == evt_done){
+                done_move[evt.axis][evt.rod] = max(done_move[evt.axis][evt.rod], evt.move);
+            } else {
+                tick_log.add(evt.t_ms, "%s %s %s at %.2f, going to %.2f", rod_names[evt.rod].c_str(), evt.axis == lin ? "lin" : "rot",
+                        evt.type == evt_stall ? "stalled" : "off its profile", evt.pos, evt.target);
+            }
+        }
+        ball_pos_fast.assign(vis.ball_pos_fast, vis.ball_pos_fast + 3);
+        ball_pos_slow.assign(vis.ball_pos_slow, vis.ball_pos_slow + 3);
+        ball_vel.assign(vis.ball_vel, vis.ball_vel + 3);
+        ball_std.assign(vis.ball_std, vis.ball_std + 3);
+        ball_in_motion = vis.ball_in_motion;
+        ball_seen_ago_ms = start_t - vis.ball_seen_ms;
+        rods_ahead(vis.rod_pos, vis.rod_vel, rod_lookahead_ms / 1000, rod_pos_ahead);
+
+        // Viewer redraws at display rate, one frame per period however fast
+        // the loop ticks. One defer per frame, uWS fans it out to subscribers
+        uWS::App *app = ws_app.load(memory_order_acquire);
+        if(app && start_t - t_telemetry >= 1000 / telemetry_hz){
+            t_telemetry = start_t;
+            double t_build = now_ms();
+            telemetry_frame frame;
+            frame.version = telemetry_version;
+            frame.seq = n_telemetry++;
+            frame.state = state;
+            for(int r = 0; r < num_rod_t; ++r){
+                frame.red_pos[r] = cur_pos[lin][r] / lin_range_cm[r];
+                frame.red_rot[r] = cur_pos[rot][r];
+                frame.red_vel[r] = mtr.profile[lin][r].vel_at(start_t);
+                frame.blue_pos[r] = vis.rod_in_vision[r] ? vis.rod_pos[lin][r] / lin_range_cm[r] : 0.5;
+                frame.blue_rot[r] = vis.rod_in_vision[r] ? vis.rod_pos[rot][r] : 0;
             }
+            frame.ball_pos[0] = ball_pos_fast[0] / play_height;
+            frame.ball_pos[1] = ball_pos_fast[1] / play_width;
+            frame.ball_pos[2] = 0;
+            for(int j = 0; j < 3; ++j) frame.ball_vel[j] = ball_vel[j];
+            loop->defer([app, frame, &telem](){
+                double t0 = now_ms();
+                app->publish(telemetry_topic, string_view((const char *)&frame, sizeof(frame)), uWS::OpCode::BINARY);
+                telem.publish_hist.add((now_ms() - t0) * 1000);
+                telem.n_frames.fetch_add(1, memory_order_relaxed);
+                telem.n_bytes.fetch_add(sizeof(frame) * telem.n_clients.load(memory_order_relaxed), memory_order_relaxed);
+            });
+            telem.build_hist.add((now_ms() - t_build) * 1000);
         }
 
-        double dt_ms = mgr.TimeStampMsec() - time_ms;
-        time_ms = mgr.TimeStampMsec();
+        double dt_ms = now_ms() - time_ms;
+        time_ms = now_ms();
 
 
         if(controller){
@@ -805,6 +1097,13 @@ int main(int argc, char** argv){
                 }
                 break;
             }
+            // Shooter is winding up, get to where the ball is going to be
+            // when it's hit instead of waiting for it to move
+            double ball_x = ball_pos_fast[0];
+            if(vis.rod_windup[closest.second]){
+                ball_x = clamp(ball_x + vis.rod_vel[lin][closest.second] * windup_lead_ms / 1000, 0.0, play_height);
+            }
+
             if(closest.second == three_bar) front = two_bar;
             else if(closest.second == five_bar) front = five_bar;
             else front = three_bar;
@@ -817,7 +1116,14 @@ int main(int argc, char** argv){
 
             auto move_motor = [&](double pos, double vel, double accel, int plr, int rod, double period, double dx){
                 double offset = plr_offset(plr, rod);
-                if(time_ms - mtr_t_last_cmd[lin][rod] > period && abs(pos - offset - mtr_last_cmd[lin][rod].pos) > dx){
+                if(use_tracking){
+                    // Everything moved this way is following the ball
+                    track_lin(rod, pos - offset, ball_vel[0], vel, accel);
+                    return;
+                }
+                // No point holding back a retarget if the rod has already stopped
+                bool idle = mtr.profile[lin][rod].arrived(time_ms);
+                if((idle || time_ms - mtr_t_last_cmd[lin][rod] > period) && abs(pos - offset - mtr_last_cmd[lin][rod].pos) > dx){
                     mtr_cmds[lin][rod] = {pos - offset, vel, accel};
                 }
             };
@@ -826,10 +1132,10 @@ int main(int argc, char** argv){
 
             if(front == two_bar){
                 static int dir = 1; // Side that goalie is from two_bar
-                double target_cm = ball_pos_fast[0];
+                double target_cm = ball_x;
 
-                if(abs(ball_pos_fast[0] - play_height/2) > goal_width/2){
-                    int side = ball_pos_fast[0] > play_height/2 ? 1 : -1;
+                if(abs(ball_x - play_height/2) > goal_width/2){
+                    int side = ball_x > play_height/2 ? 1 : -1;
                     double target_cm = play_height/2 + side*5;
                     mtr_cmds[lin][two_bar] = {target_cm - offset_two_bar, 100, 1000};
                     mtr_cmds[lin][goalie] = {side == 1 ? lin_range_cm[goalie] : 0, 100, 1000};
@@ -840,10 +1146,10 @@ int main(int argc, char** argv){
                     mtr_cmds[rot][two_bar] = {catch_angle, 4000, 40000};
                     mtr_cmds[rot][goalie] = {catch_angle, 4000, 40000};
 
-                    move_motor(ball_pos_fast[0] - dir*2, 100, 1000, 0, two_bar, 20, 0.5);
-                    move_motor(ball_pos_fast[0] + dir*3, 100, 1000, 1, goalie, 20, 0.5);
+                    move_motor(ball_x - dir*2, 100, 1000, 0, two_bar, 20, 0.5);
+                    move_motor(ball_x + dir*3, 100, 1000, 1, goalie, 20, 0.5);
 
-                } else if(abs(ball_pos_fast[0] - play_height/2) > 6 && abs(ball_pos_fast[0] - play_height/2) < 10){
+                } else if(abs(ball_x - play_height/2) > 6 && abs(ball_x - play_height/2) < 10){
                     // Pull/push shot
                     mtr_cmds[rot][two_bar] = {catch_angle, 4000, 40000};
                     mtr_cmds[rot][goalie] = {catch_angle, 4000, 40000};
@@ -856,21 +1162,21 @@ int main(int argc, char** argv){
                         far = !far;
                     }
 
-                    int side = ball_pos_fast[0] > play_height/2 ? 1 : -1;
-                    move_motor(ball_pos_fast[0] - side*1, 100, 500, 0, two_bar, 20, 0.5);
-                    move_motor(ball_pos_fast[0] - side*(far ? 11 : 8), 100, 500, 1, goalie, 20, 0.5);
+                    int side = ball_x > play_height/2 ? 1 : -1;
+                    move_motor(ball_x - side*1, 100, 500, 0, two_bar, 20, 0.5);
+                    move_motor(ball_x - side*(far ? 11 : 8), 100, 500, 1, goalie, 20, 0.5);
                 } else {
                     mtr_cmds[rot][two_bar] = {catch_angle, 4000, 40000};
                     mtr_cmds[rot][goalie] = {catch_angle, 4000, 40000};
 
-                    move_motor(ball_pos_fast[0] - dir*2, 100, 1000, 0, two_bar, 20, 0.5);
-                    move_motor(ball_pos_fast[0] + dir*3, 100, 1000, 1, goalie, 20, 0.5);
+                    move_motor(ball_x - dir*2, 100, 1000, 0, two_bar, 20, 0.5);
+                    move_motor(ball_x + dir*3, 100, 1000, 1, goalie, 20, 0.5);
                 } 
             }
             if(front == five_bar || front == three_bar){
                 mtr_cmds[rot][two_bar] = {catch_angle, 4000, 40000};
                 mtr_cmds[rot][goalie] = {catch_angle, 4000, 40000};
-                if(ball_pos_fast[0] < play_height/2){
+                if(ball_x < play_height/2){
                     mtr_cmds[lin][two_bar] = {27.5, 100, 300};
                     mtr_cmds[lin][goalie] = {2.5, 100, 300};
                 } else {
@@ -879,8 +1185,8 @@ int main(int argc, char** argv){
                 }
             }
             if(front == five_bar){
-                if(ball_pos_fast[0] >= play_height/2-goal_width/2 && ball_pos_fast[0] <= play_height/2+goal_width/2){
-                    move_motor(ball_pos_fast[0], 100, 500, closest_plr(five_bar, ball_pos_fast[0], cur_pos[lin][five_bar]), five_bar, 20, 0.5);
+                if(ball_x >= play_height/2-goal_width/2 && ball_x <= play_height/2+goal_width/2){
+                    move_motor(ball_x, 100, 500, closest_plr(five_bar, ball_x, cur_pos[lin][five_bar]), five_bar, 20, 0.5);
                 } else {
                     static bool lane = true;
                     const int exp_t_lane = 500;
@@ -889,10 +1195,10 @@ int main(int argc, char** argv){
                     }
 
                     if(lane){
-                        move_motor(ball_pos_fast[0], 100, 1000, closest_plr(five_bar, ball_pos_fast[0], cur_pos[lin][five_bar]), five_bar, 20, 0.5);
+                        move_motor(ball_x, 100, 1000, closest_plr(five_bar, ball_x, cur_pos[lin][five_bar]), five_bar, 20, 0.5);
                         mtr_cmds[rot][five_bar] = {-25, 4000, 40000};
                     } else{
-                        mtr_cmds[lin][five_bar] = {ball_pos_fast[0] < play_height/2 ? 0 : lin_range_cm[five_bar], 100, 1000};
+                        mtr_cmds[lin][five_bar] = {ball_x < play_height/2 ? 0 : lin_range_cm[five_bar], 100, 1000};
                         mtr_cmds[rot][five_bar] = {25, 4000, 40000};
                     }
                 }
@@ -900,12 +1206,12 @@ int main(int argc, char** argv){
             if(front == three_bar){
                 mtr_cmds[rot][five_bar] = {-25, 4000, 40000};
                 mtr_cmds[rot][three_bar] = {-25, 4000, 40000};
-                if(ball_pos_fast[0] < play_height/2){
+                if(ball_x < play_height/2){
                     mtr_cmds[lin][five_bar] = {0, 100, 300};
                 } else {
                     mtr_cmds[lin][five_bar] = {lin_range_cm[five_bar], 100, 300};
                 }
-                move_motor(ball_pos_fast[0], 100, 1000, closest_plr(three_bar, ball_pos_fast[0], cur_pos[lin][five_bar]), three_bar, 20, 0.5);
+                move_motor(ball_x, 100, 1000, closest_plr(three_bar, ball_x, cur_pos[lin][five_bar]), three_bar, 20, 0.5);
             }
             break;
         }
@@ -920,17 +1226,35 @@ int main(int argc, char** argv){
                 }
                 break;
             }
+            // Filtered state is low latency and low noise, so prefer it whenever the filter is confident
+            const double max_std_cm = 0.5;
+            bool use_filtered = !use_ewma && ball_std[0] < max_std_cm && ball_std[1] < max_std_cm;
+            const vector<double> &ball_pos = use_filtered ? ball_pos_slow : ball_pos_fast;
             for(int r = 0; r < num_rod_t; ++r){
                 // If ball is already past this rod, do nothing
-                if(ball_pos_fast[1] < rod_coord[r]-rod_gap/2) continue;
-
-                // Predict trajectory
-                double target_cm = ball_pos_fast[0];
+                if(ball_pos[1] < rod_coord[r]-rod_gap/2) continue;
+
+                // Predict trajectory, unless the ball is in the air where the
+                // velocity is mostly marker noise, then just cover it. The
+                // filter's std is blown up in the air so ball_pos is the raw
+                // marker there, cover the smoothed position instead
+                double target_cm = ball_pos[0];
+                if(vis.ball_airborne){
+                    target_cm = ball_pos_slow[0];
+                    int plr = closest_plr(r, target_cm, cur_pos[lin][r]);
+                    if(r == goalie) plr = 1;
+                    if(use_tracking) track_lin(r, target_cm - plr_offset(plr, r), 0, 150, 1000);
+                    else mtr_cmds[lin][r] = {target_cm - plr_offset(plr, r), 150, 1000};
+                    continue;
+                }
                 // ball_vel[1] is negative so this is positive
-                double dt = (rod_coord[r] - ball_pos_fast[1]) / ball_vel[1];
+                double dt = (rod_coord[r] - ball_pos[1]) / ball_vel[1];
                 /* dt -= 30; */
                 /* if(r != five_bar) */
                     target_cm += ball_vel[0] * dt;
+                // Same wall model as the filter
+                double target_vel = ball_vel[0];
+                if(use_filtered) reflect_walls(target_cm, target_vel);
                 /* log << "dt: " << dt << ", ball_vel[0]: " << ball_vel[0] << ", ball_vel[1]: " << ball_vel[1] << ", target_cm: " << target_cm << endl; */
 
                 int plr = closest_plr(r, target_cm, cur_pos[lin][r]);
@@ -938,6 +1262,12 @@ int main(int argc, char** argv){
 
                 double plr_offset_cm = plr_offset(plr, r);
 
+                // The intercept point barely moves for a straight shot, so
+                // nothing to feed forward
+                if(use_tracking){
+                    track_lin(r, target_cm - plr_offset_cm, 0, 150, 1000);
+                    continue;
+                }
                 mtr_cmds[lin][r] = {
                     .pos = target_cm - plr_offset_cm,
                     .vel = 150,
@@ -952,14 +1282,17 @@ int main(int argc, char** argv){
             if(closest.first != bot){
                 state = state_defense;
                 break;
-            } else if(!ball_in_motion){
+            } else if(!ball_in_motion && ball_seen_ago_ms < 50){
+                // Not if it just stopped moving because we lost it
                 state = state_controlled_move;
             }
             int rod = closest.second;
             int plr = closest_plr(rod, ball_pos_fast[0], cur_pos[lin][rod]);
             mtr_cmds[rot][rod] = {35, 5'000, 50'000};
 
-            if(time_ms - mtr_t_last_cmd[lin][rod] > 40){
+            if(use_tracking){
+                track_lin(rod, ball_pos_fast[0] - plr_offset(plr, rod), ball_vel[0], 100, 1000);
+            } else if(time_ms - mtr_t_last_cmd[lin][rod] > 40){
                 mtr_cmds[lin][rod] = {ball_pos_fast[0] - plr_offset(plr, rod), 100, 1000};
             }
             break;
@@ -977,15 +1310,15 @@ int main(int argc, char** argv){
 
 
             if(abs(cur_pos[rot][rod] - dir*catch_angle) < 2){
-                status << "1" << endl;
+                ctrl_out.debug[0] = 1;
                 if(abs(cur_pos[lin][rod] + plr_offset(plr, rod) - ball_pos_fast[0]) > 0.5 && time_ms - mtr_t_last_cmd[lin][rot] > 20){
                     mtr_cmds[lin][rod] = {ball_pos_fast[0] - plr_offset(plr, rod), 100, 1000};
                 }
             } else if(abs(ball_pos_fast[0] - cur_pos[lin][rod] - plr_offset(plr, rod)) > ball_rad+foot_width/2+2){
-                status << "2" << endl;
+                ctrl_out.debug[0] = 2;
                 mtr_cmds[rot][rod] = {dir*catch_angle, 10'000, 100'000};
             } else if(abs(ball_pos_fast[0] - mtr_last_cmd[lin][rod].pos - plr_offset(plr, rod)) < ball_rad+foot_width/2+2) {
-                status << "3" << endl;
+                ctrl_out.debug[0] = 3;
                 double target_cm = ball_pos_fast[0] + ball_rad + foot_width/2 + 3;
                 if(!can_plr_reach(plr, rod, target_cm, 0)){
                     target_cm = ball_pos_fast[0] - ball_rad - foot_width/2 - 3;
@@ -996,8 +1329,8 @@ int main(int argc, char** argv){
             break;
         }
         // Convenience macros for waiting for rot/lin motions to finish respectively
-#define wait_rot if(abs(cur_pos[rot][rod] - mtr_last_cmd[rot][rod].pos) < 1.0 && time_ms - control_task_timer > 50)
-#define wait_lin if(abs(cur_pos[lin][rod] - mtr_last_cmd[lin][rod].pos) < 0.1 && time_ms - control_task_timer > 50)
+#define wait_rot if(mtr_done(rot, rod))
+#define wait_lin if(mtr_done(lin, rod))
 #define wait_time(T) if(time_ms - control_task_timer >= (T))
         /******************************************************************************
          * Five bar passing
@@ -1008,13 +1341,15 @@ int main(int argc, char** argv){
             static double t_lane_open = time_ms;
             static double t_start = time_ms;
             static double t_human = time_ms;
+            // When the lane pass wind-up and line-up are planned to finish
+            static double t_contact = time_ms;
 
             pair<side_t, rod_t> closest = closest_rod(ball_pos_fast[1]);
             side_t side = closest.first;
             rod_t rod = closest.second;
             if(side == human && c5b_task != c5b_fast_5 && c5b_task != c5b_threaten_5){
                 /* if(time_ms - t_human > 90){ */
-                log << "Lost from pass" << endl;
+                tick_log.add(time_ms, "Lost from pass");
                 state = state_defense;
                 c5b_task = c5b_init;
                 /* } */
@@ -1053,7 +1388,7 @@ int main(int argc, char** argv){
                 } else if(rod == five_bar){
                     c5b_task = c5b_fast_1;
                 } else {
-                    log << "Attempting to pass from wrong rod" << endl;
+                    tick_log.add(time_ms, "Attempting to pass from wrong rod");
                     c5b_task = c5b_init;
                     state = state_controlled_move;
                 }
@@ -1063,18 +1398,16 @@ int main(int argc, char** argv){
                 mtr_cmds[lin][rod] = {ball_pos_fast[0]+ball_rad+foot_width/2-plr_offset(1, rod)+0.3, 50, 500};
                 mtr_cmds[lin][three_bar] = {0.05, 150, 1500};
                 mtr_cmds[rot][three_bar] = {-40, 5000, 50000};
-                mtr_fns.push([](){
-                    nodes[rot][three_bar].get().Limits.TrqGlobal = 100;
-                });
+                mtr_dispatch.torque(rot, three_bar, 100);
                 c5b_task = c5b_fast_2;
                 control_task_timer = time_ms;
                 break;
             case c5b_fast_2:
                 wait_lin{
-                    if(is_blocked(rod, ball_rad + 0.1, rod_pos, 1, three_bar)){
+                    if(is_blocked(rod, ball_rad + 0.1, rod_pos_ahead, 1, three_bar)){
                         t_wall_open = time_ms;
                     }
-                    if(is_blocked(rod, 12, rod_pos, 1, three_bar)){
+                    if(is_blocked(rod, 12, rod_pos_ahead, 1, three_bar)){
                         t_lane_open = time_ms;
                     }
                     double t_thresh = 3*(1-(time_ms - t_start)/10'000)*1000 + (rand()%1000-200);
@@ -1110,14 +1443,20 @@ int main(int argc, char** argv){
                 break;
             case c5b_fast_lane_3:
                 wait_time(90){
-                    mtr_cmds[rot][rod] = {60, 10000, 100000};
-                    mtr_cmds[lin][rod] = {13.5-plr_offset(0, rod), 150, 1500};
+                    // Wind up and line up so both are done right when the
+                    // strike goes, 70ms out, rather than whenever they get there
+                    const double target[num_axis_t] = {13.5-plr_offset(0, rod), 60};
+                    const double vmax[num_axis_t] = {150, 10000};
+                    const double amax[num_axis_t] = {1500, 100000};
+                    coord_plan plan = coord_move(rod, target, time_ms + 70, vmax, amax);
+                    if(!plan.feasible) tick_log.add(time_ms, "Lane pass line-up %.1fms late", plan.t_arrive_ms - time_ms - 70);
+                    t_contact = plan.t_arrive_ms;
                     c5b_task = c5b_fast_lane_4;
                     control_task_timer = time_ms;
                 }
                 break;
             case c5b_fast_lane_4:
-                wait_time(70){
+                if(time_ms >= t_contact){
                     mtr_cmds[rot][rod] = {-90, 4000, 40000};
                     c5b_task = c5b_fast_5;
                     control_task_timer = time_ms;
@@ -1136,9 +1475,7 @@ int main(int argc, char** argv){
                     mtr_cmds[rot][three_bar] = {-60, 1000, 10000};
                     c5b_task = c5b_fast_6;
                     control_task_timer = time_ms;
-                    mtr_fns.push([](){
-                        nodes[rot][three_bar].get().Limits.TrqGlobal = 100;
-                    });
+                    mtr_dispatch.torque(rot, three_bar, 100);
                 }
                 break;
             case c5b_fast_6:
@@ -1204,7 +1541,7 @@ int main(int argc, char** argv){
                 wait_time(300){
 
                     /* int plr_five_bar = closest_plr(five_bar, ball_cm, cur_pos[lin][rod-1]); */
-                    if(!is_blocked(rod, ball_pos_fast[0], rod_pos, 0.2) && abs(cur_pos[lin][rod] + plr_offset(plr_passer, rod) - ball_pos_fast[0]) < 0.5){
+                    if(!is_blocked(rod, ball_pos_fast[0], rod_pos_ahead, 0.2) && abs(cur_pos[lin][rod] + plr_offset(plr_passer, rod) - ball_pos_fast[0]) < 0.5){
                         break;
                         mtr_cmds[rot][rod] = {
                             .pos = -120,
@@ -1217,8 +1554,8 @@ int main(int argc, char** argv){
                             .accel = 100'000,
                         };
                         c5b_task = c5b_idle;
-                        log << "Pass shot" << endl;
-                    }else if(!is_blocked(rod, ball_cm, rod_pos, 2, rod-1) && abs(cur_pos[lin][rod] + plr_offset(plr_passer, rod) - ball_cm) < 4){
+                        tick_log.add(time_ms, "Pass shot");
+                    }else if(!is_blocked(rod, ball_cm, rod_pos_ahead, 2, rod-1) && abs(cur_pos[lin][rod] + plr_offset(plr_passer, rod) - ball_cm) < 4){
                         /* mtr_cmds[lin][rod] = { */
                         /*     .pos = ball_cm - plr_offset(plr_passer, five_bar), */
                         /*     .vel = 300, */
@@ -1237,7 +1574,7 @@ int main(int argc, char** argv){
                         c5b_task = c5b_threaten_5;
                         control_task_timer = time_ms;
                         pass_cm = ball_cm;
-                        log << "Pass" << endl;
+                        tick_log.add(time_ms, "Pass");
                     }else if(time_ms - mtr_t_last_cmd[lin][rod] > 50){
                         /* mtr_cmds[lin][rod] = { */
                         /*     .pos = ball_cm - plr_offset_cm, */
@@ -1255,12 +1592,12 @@ int main(int argc, char** argv){
             }
             case c5b_threaten_4:
                 if(threaten_dir == 1 ? (ball_pos_fast[0] >= pass_cm-1) : (ball_pos_fast[0] <= pass_cm + 1)){
-                    if(is_blocked(five_bar, pass_cm, rod_pos, 1, rod-1)){
-                        log << "Abort pass!" << endl;
+                    if(is_blocked(five_bar, pass_cm, rod_pos_ahead, 1, rod-1)){
+                        tick_log.add(time_ms, "Abort pass!");
                         c5b_task = c5b_threaten_3;
                         break;
                     }
-                    if(!is_blocked(rod, pass_cm, rod_pos, 0.5)){
+                    if(!is_blocked(rod, pass_cm, rod_pos_ahead, 0.5)){
                         mtr_cmds[rot][rod] = {
                             .pos = -120,
                             .vel = 20'000,
@@ -1272,7 +1609,7 @@ int main(int argc, char** argv){
                             .accel = 100'000,
                         };
                         c5b_task = c5b_idle;
-                        log << "Slow shot!" << endl;
+                        tick_log.add(time_ms, "Slow shot!");
                     } else {
                         mtr_cmds[rot][rod] = {
                             .pos = -60,
@@ -1281,7 +1618,7 @@ int main(int argc, char** argv){
                         };
                         c5b_task = c5b_threaten_5;
                         control_task_timer = time_ms;
-                        log << "Pass!" << endl;
+                        tick_log.add(time_ms, "Pass!");
                     }
                 }
                 break;
@@ -1297,7 +1634,7 @@ int main(int argc, char** argv){
                     };
                 }
                 wait_time(300){
-                    log << "Releasing pass" << endl;
+                    tick_log.add(time_ms, "Releasing pass");
                     mtr_cmds[rot][five_bar] = {
                         .pos = -90,
                         .vel = 4000,
@@ -1354,7 +1691,7 @@ int main(int argc, char** argv){
                 state = state_defense;
                 cmove_task = cmove_init;
                 for(auto fn : leave_fns) fn();
-                log << "Went to human" << endl;
+                tick_log.add(time_ms, "Went to human");
                 break;
             } else if(rod != cur_rod){
                 cmove_task = cmove_init;
@@ -1398,7 +1735,7 @@ int main(int argc, char** argv){
                     }
                 }
                 wait_time(2500){
-                    log << "Exited decision because of timeout" << endl;
+                    tick_log.add(time_ms, "Exited decision because of timeout");
                     cmove_task = cmove_decide_2;
                 }
                 break;
@@ -1408,7 +1745,7 @@ int main(int argc, char** argv){
                 if(rod != goalie && abs(ball_pos[0] - cmove_target_cm[0]) < cmove_target_tol[0] && abs(ball_pos[1] - rod_coord[rod] - cmove_target_cm[1]) < cmove_target_tol[1]){
                     // Pin shots need to be setup up with pin even if they happen to get in position, since the player has to be on top
                     if(pin_setup && !(cur_pos[rot][rod] <= -40 && cur_pos[rot][rod] >= -65)){
-                        log << "Doing pin " << cur_pos[rot][rod] << endl;
+                        tick_log.add(time_ms, "Doing pin %.2f", cur_pos[rot][rod]);
                         cmove_task = cmove_pin_1;
                         break;
                     }
@@ -1419,7 +1756,7 @@ int main(int argc, char** argv){
                         end_side = true;
                         break;
                     }
-                    log << "Move reached target, going to " << cmove_next_state << endl;
+                    tick_log.add(time_ms, "Move reached target, going to %d", cmove_next_state);
                     state = cmove_next_state;
                     cmove_task = cmove_init;
                     for(auto fn : leave_fns) fn();
@@ -1483,7 +1820,7 @@ int main(int argc, char** argv){
                     plr = closest_plr(rod, target_cm, lin_range_cm[rod]/2);
                     if(rod == three_bar && target_cm <= 15.5) plr = 0; // very hacky, but whatever
                     if(!can_plr_reach(plr, rod, target_cm, 1)){
-                        log << "Giving up from side" << endl;
+                        tick_log.add(time_ms, "Giving up from side");
                         cmove_task = cmove_give_up_1;
                     } else {
                         mtr_cmds[lin][rod] = {
@@ -1568,7 +1905,7 @@ int main(int argc, char** argv){
             {
                 double pos = cur_pos[lin][rod] + 3*target_side;
                 if(pos < 0 || pos >= lin_range_cm[rod]){
-                    log << "Giving up from tap" << endl;
+                    tick_log.add(time_ms, "Giving up from tap");
                     cmove_task = cmove_give_up_1;
                     break;
                 }
@@ -1637,7 +1974,8 @@ int main(int argc, char** argv){
                         .accel = 30000,
                     };
                 }
-                status << cur_pos[lin][rod] << ", " << mtr_last_cmd[lin][rod].pos << endl;
+                ctrl_out.debug[0] = cur_pos[lin][rod];
+                ctrl_out.debug[1] = mtr_last_cmd[lin][rod].pos;
                 wait_lin{
                     cmove_task = cmove_decide_1;
                     control_task_timer = time_ms;
@@ -1649,7 +1987,7 @@ int main(int argc, char** argv){
                 double pos = clamp(cmove_target_cm[0] - side*(ball_rad+foot_width/2) - plr_offset(plr, rod), 0.0, lin_range_cm[rod]);
                 double tol = 1;
                 if((side == 1 && lin_range_cm[rod]-cur_pos[lin][rod] < tol) || (side == -1 && cur_pos[lin][rod] < tol)){
-                    log << "Giving up from adjust" << endl;
+                    tick_log.add(time_ms, "Giving up from adjust");
                     cmove_task = cmove_give_up_1;
                 } else {
                     mtr_cmds[lin][rod] = {
@@ -1678,13 +2016,9 @@ int main(int argc, char** argv){
             }
             case cmove_unstuck_1:
             {
-                mtr_fns.push([rod](){
-                    nodes[rot][rod].get().Limits.TrqGlobal = 10;
-                });
-                leave_fns.push_back([&mtr_fns, rod](){
-                    mtr_fns.push([rod](){
-                        nodes[rot][rod].get().Limits.TrqGlobal = 100;
-                    });
+                mtr_dispatch.torque(rot, rod, 10);
+                leave_fns.push_back([&mtr_dispatch, rod](){
+                    mtr_dispatch.torque(rot, rod, 100);
                 });
                 /* double dy = 2*(abs(ball_pos[1]-rod_coord[rod])-5); */
                 mtr_cmds[rot][rod] = {
@@ -1718,10 +2052,8 @@ int main(int argc, char** argv){
                 break;
             case cmove_unstuck_3:
                 wait_time(1000){
-                    log << "Resetting torque" << endl;
-                    mtr_fns.push([rod](){
-                        nodes[rot][rod].get().Limits.TrqGlobal = 100;
-                    });
+                    tick_log.add(time_ms, "Resetting torque");
+                    mtr_dispatch.torque(rot, rod, 100);
                     cmove_task = cmove_decide_1;
                     control_task_timer = time_ms;
                 }
@@ -1801,7 +2133,7 @@ int main(int argc, char** argv){
                         };
                     }
                 }
-                log << "Giving up move" << endl;
+                tick_log.add(time_ms, "Giving up move");
                 cmove_task = cmove_give_up_2;
                 break;
             }
@@ -1940,10 +2272,8 @@ int main(int argc, char** argv){
             pair<side_t, rod_t> closest = closest_rod(ball_pos_fast[1]);
             if(closest.first == human && time_ms - t_shot > 300){
                 state = state_shot_defense;
-                log << "Lost ball from snake " << time_ms - t_shot << endl;
-                mtr_fns.push([](){
-                    nodes[rot][rod].get().Limits.TrqGlobal = 100;
-                });
+                tick_log.add(time_ms, "Lost ball from snake %.1f", time_ms - t_shot);
+                mtr_dispatch.torque(rot, rod, 100);
                 csnake_task = csnake_init;
                 break;
             }
@@ -1962,26 +2292,22 @@ int main(int argc, char** argv){
                 t_last_turn = time_ms;
                 t_left_open = time_ms;
                 t_right_open = time_ms;
-                mtr_fns.push([](){
-                    nodes[rot][rod].get().Limits.TrqGlobal = 5;
-                });
+                mtr_dispatch.torque(rot, rod, 5);
                 csnake_task = csnake_plan;
                 break;
             case csnake_plan:
 
                 /* if(time_ms > t_shoot && cur_pos[lin][rod] - plr_offset_cm < 0.5){ */
-                if(!is_blocked(rod, ball_pos_fast[0], rod_pos, 0.1)){
+                if(!is_blocked(rod, ball_pos_fast[0], rod_pos_ahead, 0.1)){
                 /* if(false){ */
-                    mtr_fns.push([](){
-                        nodes[rot][rod].get().Limits.TrqGlobal = 100;
-                    });
+                    mtr_dispatch.torque(rot, rod, 100);
                     mtr_cmds[rot][rod] = {
                         .pos = -450,
                         .vel = 20000,
                         .accel = 200000,
                     };
                     t_shot = time_ms;
-                    log << "Snake straight shot" << endl;
+                    tick_log.add(time_ms, "Snake straight shot");
                     csnake_task = csnake_init;
                     state = state_unknown;
                     break;
@@ -1990,8 +2316,8 @@ int main(int argc, char** argv){
                 if(abs(cur_pos[lin][rod]+plr_offset_cm - ball_pos_fast[0]) < 0.5 && time_ms - t_start > 400){
                 /* if(false){ */
                     const double move_cm = 5.5;
-                    bool left_open = !is_blocked(rod, ball_pos_fast[0]-move_cm, rod_pos, 0.1);
-                    bool right_open = !is_blocked(rod, ball_pos_fast[0]+move_cm, rod_pos, 0.1);
+                    bool left_open = !is_blocked(rod, ball_pos_fast[0]-move_cm, rod_pos_ahead, 0.1);
+                    bool right_open = !is_blocked(rod, ball_pos_fast[0]+move_cm, rod_pos_ahead, 0.1);
                     if(!left_open) t_left_open = time_ms;
                     if(!right_open) t_right_open = time_ms;
                     double t_thresh = (1-(time_ms - t_start)/15000)*1500;
@@ -2001,10 +2327,8 @@ int main(int argc, char** argv){
                             .vel = 200,
                             .accel = 3000,
                         };
-                        mtr_fns.push([](){
-                            nodes[rot][rod].get().Limits.TrqGlobal = 100;
-                        });
-                        log << ball_pos_fast[0] + move_cm * (left_open ? -1 : 1) - plr_offset_cm << endl;
+                        mtr_dispatch.torque(rot, rod, 100);
+                        tick_log.add(time_ms, "%.2f", ball_pos_fast[0] + move_cm * (left_open ? -1 : 1) - plr_offset_cm);
                         t_shot = time_ms;
                         csnake_task = csnake_shoot;
                         break;
@@ -2036,7 +2360,7 @@ int main(int argc, char** argv){
                         .vel = 20000,
                         .accel = 200000,
                     };
-                    log << "Snake moving shot" << endl;
+                    tick_log.add(time_ms, "Snake moving shot");
                 }
                 if(time_ms - t_shot > 200){
                     csnake_task = csnake_init;
@@ -2056,21 +2380,46 @@ int main(int argc, char** argv){
             };
             break;
         case state_unknown:
-            status << is_blocked(three_bar, ball_pos_fast[0]-6, rod_pos, 0.3) << ", " << is_blocked(three_bar, ball_pos_fast[0], rod_pos, 0.1) << ", " << is_blocked(three_bar, ball_pos_fast[0]+6, rod_pos, 0.3) << endl;
+            ctrl_out.debug[0] = is_blocked(three_bar, ball_pos_fast[0]-6, rod_pos_ahead, 0.3);
+            ctrl_out.debug[1] = is_blocked(three_bar, ball_pos_fast[0], rod_pos_ahead, 0.1);
+            ctrl_out.debug[2] = is_blocked(three_bar, ball_pos_fast[0]+6, rod_pos_ahead, 0.3);
 
             break;
         default:
             break;
         }
 
-        print_status(status.str(), log.str(), true);
+        for(int r = 0; r < num_rod_t; ++r)
+            if(!tracked[r]) mtr_cmds[lin][r].track_vel = NAN;
+
+        // Nothing drains it without motors
+        if(motors) mtr_dispatch.post(cmds_out);
+        if(vis.publish_ms != last_frame_ms){
+            frame_cmd_hist.add((now_ms() - vis.publish_ms) * 1000);
+            last_frame_ms = vis.publish_ms;
+        } else {
+            n_stale_ticks.fetch_add(1, memory_order_relaxed);
+        }
+
+        ctrl_out.t_ms = time_ms;
+        ctrl_out.state = state;
+        ctrl_out.cmove_task = cmove_task;
+        memcpy(ctrl_out.rod_pos, rod_pos, sizeof(rod_pos));
+        ctrl_snap.publish(ctrl_out);
 
-        this_thread::sleep_for(chrono::microseconds(500));
+        if(frame_ticks) ctrl_loop.wait(new_frame);
+        else ctrl_loop.wait();
     }
 
 
+    status_thread.join();
+    if(log_file) fclose(log_file);
     cout << "Got terminate command, quitting..." << endl;
-    close_all();
+    for(const thread_stats &st : thread_report()){
+        printf("%-12s tid %-7d cpu %-3d context switches %ld voluntary, %ld involuntary, %ld migrations\n",
+                st.name.c_str(), st.tid, st.cpu, st.n_voluntary, st.n_involuntary, st.n_migrations);
+    }
+    if(motors) motors->close();
     terminate();
 
     return 0;
@@ -0,0 +1,327 @@
+#include "motor.hpp"
+#include "timing.hpp"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+/******************************************************************************
+ * Command dispatcher
+ ******************************************************************************/
+
+// NAN means unchanged, so NAN == NAN here
+bool differ(double x, double y){
+    return isnan(x) != isnan(y) || (!isnan(x) && x != y);
+}
+
+bool motor_dispatcher::push(const motor_op &op){
+    if(!ring.push(op)){
+        n_overflows.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    n_ops.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+bool motor_dispatcher::flush_pending(){
+    int n = 0;
+    while(n < n_pending && ring.push(pending[n])) ++n;
+    n_ops.fetch_add(n, memory_order_relaxed);
+    copy(pending + n, pending + n_pending, pending);
+    n_pending -= n;
+    return n_pending == 0;
+}
+
+void motor_dispatcher::push_once(const motor_op &op){
+    static_assert(3 * num_axis_t * num_rod_t <= max_motor_ops, "pending has to fit one of each one shot op per axis");
+    if(flush_pending() && ring.push(op)){
+        n_ops.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    n_overflows.fetch_add(1, memory_order_relaxed);
+    // Dropping the older one is safe, only the latest torque/stop/query for
+    // an axis matters and this one goes out after everything else held
+    auto same = [&op](const motor_op &o){ return o.type == op.type && o.axis == op.axis && o.rod == op.rod; };
+    n_pending = remove_if(pending, pending + n_pending, same) - pending;
+    pending[n_pending++] = op;
+}
+
+void motor_dispatcher::wake(){
+    // Pairs with the fence in wait(), either we see it sleeping or it sees the op
+    atomic_thread_fence(memory_order_seq_cst);
+    if(!sleeping.load(memory_order_relaxed)) return;
+    // Taking the lock means the consumer is either before its predicate check
+    // or already waiting, so the notify can't be lost
+    { lock_guard<mutex> lock(m); }
+    cv.notify_one();
+}
+
+void motor_dispatcher::post(const motor_cmds &cmds){
+    n_posts.fetch_add(1, memory_order_relaxed);
+    t_last_post.store(now_ms(), memory_order_relaxed);
+    // Torque/stop/query made before this post have to go out first
+    bool pushed = n_pending > 0;
+    if(!flush_pending()){
+        wake();
+        return;
+    }
+    auto now = clock::now();
+    // The motor thread zeroed whatever was running in velocity mode
+    long n_timeouts = n_vel_timeouts.load(memory_order_relaxed);
+    if(n_timeouts != vel_timeouts_seen){
+        vel_timeouts_seen = n_timeouts;
+        for(int a = 0; a < num_axis_t; ++a)
+            for(int r = 0; r < num_rod_t; ++r)
+                if(!isnan(posted.cmd[a][r].track_vel)) posted.cmd[a][r].track_vel = 0;
+    }
+    for(int a = 0; a < num_axis_t; ++a){
+        for(int r = 0; r < num_rod_t; ++r){
+            const motor_cmd &cmd = cmds.cmd[a][r];
+            motor_cmd &last = posted.cmd[a][r];
+            // Speed before the move so the move uses it. Going to NAN means
+            // leave it alone, nothing to send
+            if(differ(cmd.vel, last.vel) || differ(cmd.accel, last.accel)){
+                if((isnan(cmd.vel) && isnan(cmd.accel)) || push({op_speed, a, r, cmd.vel, cmd.accel, now})){
+                    last.vel = cmd.vel;
+                    last.accel = cmd.accel;
+                    pushed = true;
+                }
+            }
+            if(!isnan(cmd.track_vel)){
+                if(differ(cmd.track_vel, last.track_vel) && push({op_vel, a, r, cmd.track_vel, NAN, now})){
+                    last.track_vel = cmd.track_vel;
+                    pushed = true;
+                }
+                continue;
+            }
+            bool was_tracking = !isnan(last.track_vel);
+            if(was_tracking && isnan(cmd.pos)){
+                // Don't leave it running
+                if(push({op_vel, a, r, 0, NAN, now})){
+                    last.track_vel = NAN;
+                    pushed = true;
+                }
+            } else if(differ(cmd.pos, last.pos) || was_tracking){
+                if(isnan(cmd.pos) || push({op_move, a, r, cmd.pos, NAN, now})){
+                    last.pos = cmd.pos;
+                    last.track_vel = NAN;
+                    pushed = true;
+                }
+            }
+        }
+    }
+    if(pushed) wake();
+}
+
+void motor_dispatcher::torque(int axis, int rod, double pct){
+    push_once({op_torque, axis, rod, pct, NAN, clock::now()});
+    wake();
+}
+
+void motor_dispatcher::stop(int axis, int rod){
+    push_once({op_stop, axis, rod, NAN, NAN, clock::now()});
+    wake();
+}
+
+void motor_dispatcher::query(int axis, int rod){
+    push_once({op_query, axis, rod, NAN, NAN, clock::now()});
+    wake();
+}
+
+int motor_dispatcher::wait(motor_op ops[max_motor_ops], double timeout_ms){
+    if(ring.empty() && timeout_ms > 0){
+        unique_lock<mutex> lock(m);
+        sleeping.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        auto timeout = chrono::duration<double, milli>(timeout_ms);
+        if(cv.wait_for(lock, timeout, [&]{ return !ring.empty(); })) n_wakeups.fetch_add(1, memory_order_relaxed);
+        sleeping.store(false, memory_order_relaxed);
+    }
+
+    int n = 0;
+    while(n < max_motor_ops && ring.pop(ops[n])) ++n;
+
+    // Walk backwards dropping moves/speeds with a newer one for the same axis
+    // behind them. Torque and stop are barriers, nothing is reordered across
+    // them. A move is also a barrier for speeds, so a speed sent with a move
+    // still goes out ahead of it
+    bool later_move[num_axis_t][num_rod_t] = {};
+    int later_speed[num_axis_t][num_rod_t];
+    for(int a = 0; a < num_axis_t; ++a)
+        for(int r = 0; r < num_rod_t; ++r)
+            later_speed[a][r] = -1;
+    bool keep[max_motor_ops];
+    for(int i = n - 1; i >= 0; --i){
+        const motor_op &op = ops[i];
+        keep[i] = true;
+        // A move or velocity move replaces whichever came before it
+        if(op.type == op_move || op.type == op_vel){
+            keep[i] = !later_move[op.axis][op.rod];
+            later_move[op.axis][op.rod] = true;
+            later_speed[op.axis][op.rod] = -1;
+        } else if(op.type == op_speed){
+            int j = later_speed[op.axis][op.rod];
+            if(j >= 0){
+                // NAN in the newer one means keep this one's value
+                if(isnan(ops[j].a)) ops[j].a = op.a;
+                if(isnan(ops[j].b)) ops[j].b = op.b;
+                keep[i] = false;
+            } else {
+                later_speed[op.axis][op.rod] = i;
+            }
+        } else if(op.type == op_torque || op.type == op_stop){
+            later_move[op.axis][op.rod] = false;
+            later_speed[op.axis][op.rod] = -1;
+        }
+    }
+    int n_kept = 0;
+    for(int i = 0; i < n; ++i){
+        if(keep[i]) ops[n_kept++] = ops[i];
+    }
+    n_coalesced.fetch_add(n - n_kept, memory_order_relaxed);
+    return n_kept;
+}
+
+void motor_dispatcher::issued(const motor_op &op){
+    n_issued[op.type].fetch_add(1, memory_order_relaxed);
+    latency_hist.add(chrono::duration<double, micro>(clock::now() - op.t_post).count());
+}
+
+/******************************************************************************
+ * Port I/O
+ ******************************************************************************/
+
+port_pool::port_pool(motor_backend *motors, function<void(int)> on_start) : motors(motors), n_ports(clamp(motors->num_ports(), 1, max_motor_ports)) {
+    // Port 0 runs on the caller
+    for(int p = 1; p < n_ports; ++p){
+        workers[p].th = thread([this, p, on_start](){
+            if(on_start) on_start(p);
+            worker &w = workers[p];
+            uint32_t seen = 0;
+            for(;;){
+                w.go.wait(seen, memory_order_acquire);
+                seen = w.go.load(memory_order_acquire);
+                if(quit.load(memory_order_relaxed)) return;
+                for(motor_io *io : w.jobs) exec(*io);
+                if(pending.fetch_sub(1, memory_order_acq_rel) == 1) pending.notify_one();
+            }
+        });
+    }
+}
+
+port_pool::~port_pool(){
+    quit = true;
+    for(int p = 1; p < n_ports; ++p){
+        workers[p].go.fetch_add(1, memory_order_release);
+        workers[p].go.notify_one();
+        workers[p].th.join();
+    }
+}
+
+void port_pool::exec(motor_io &io){
+    const motor_op &op = io.op;
+    io.ok = true;
+    io.t_start = now_ms();
+    try{
+        switch(op.type){
+        case op_move: motors->move(op.axis, op.rod, op.a); break;
+        case op_vel: motors->move_vel(op.axis, op.rod, op.a); break;
+        case op_speed: motors->set_speed(op.axis, op.rod, op.a, op.b); break;
+        case op_torque: motors->set_torque(op.axis, op.rod, op.a); break;
+        case op_stop: motors->stop(op.axis, op.rod); break;
+        case op_query: io.pos = motors->read_pos(op.axis, op.rod); break;
+        default: break;
+        }
+    } catch(motor_error &err){
+        io.ok = false;
+        io.err = err.what();
+    }
+    io.t_end = now_ms();
+}
+
+void port_pool::run(motor_io *ios, int n){
+    if(n_ports == 1){
+        for(int i = 0; i < n; ++i) exec(ios[i]);
+        return;
+    }
+    for(int p = 0; p < n_ports; ++p) workers[p].jobs.clear();
+    for(int i = 0; i < n; ++i) workers[motors->port(ios[i].op.axis, ios[i].op.rod)].jobs.push_back(&ios[i]);
+
+    int n_busy = 0;
+    for(int p = 1; p < n_ports; ++p) n_busy += !workers[p].jobs.empty();
+    pending.store(n_busy, memory_order_relaxed);
+    for(int p = 1; p < n_ports; ++p){
+        if(workers[p].jobs.empty()) continue;
+        workers[p].go.fetch_add(1, memory_order_release);
+        workers[p].go.notify_one();
+    }
+
+    for(motor_io *io : workers[0].jobs) exec(*io);
+    for(int left; (left = pending.load(memory_order_acquire)) != 0;) pending.wait(left, memory_order_acquire);
+}
+
+/******************************************************************************
+ * Motion events
+ ******************************************************************************/
+
+void motion_monitor::moved(int axis, int rod, const axis_profile &prof, double target, long move){
+    watch &mw = w[axis][rod];
+    mw.move = move;
+    mw.moving = true;
+    mw.follow_err = mw.stalled = false;
+    mw.issued = prof;
+    mw.target = target;
+    mw.t_still = NAN;
+}
+
+void motion_monitor::idle(int axis, int rod){
+    w[axis][rod].moving = false;
+}
+
+int motion_monitor::check(int axis, int rod, const motor_state &mtr, motor_event out[num_motor_evt_t]){
+    watch &mw = w[axis][rod];
+    if(!mw.moving) return 0;
+    const pos_series &h = mtr.history[axis][rod];
+    if(h.n == 0) return 0;
+
+    int n = 0;
+    double t = h.get(0).t_ms, pos = h.get(0).pos;
+    auto emit = [&](motor_evt_t type){ out[n++] = {type, axis, rod, t, pos, mw.target, mw.move}; };
+
+    bool still = abs(h.vel(still_window_ms)) < still_vel[axis];
+    bool there = abs(pos - mw.issued.tz.target) < done_tol[axis];
+    if(still && there){
+        emit(evt_done);
+        mw.moving = false;
+        return n;
+    }
+
+    if(!mw.follow_err && abs(pos - mw.issued.pos_at(t)) > follow_err_max[axis]){
+        emit(evt_follow_err);
+        mw.follow_err = true;
+    }
+
+    // Stopped short. A move sent to a stopped axis takes a sample or two to
+    // get going, well under stall_ms
+    if(still){
+        if(isnan(mw.t_still)) mw.t_still = t;
+        if(!mw.stalled && t - mw.t_still >= stall_ms){
+            emit(evt_stall);
+            mw.stalled = true;
+        }
+    } else {
+        mw.t_still = NAN;
+    }
+    return n;
+}
+
+void motor_events::push(const motor_event &evt){
+    n_events[evt.type].fetch_add(1, memory_order_relaxed);
+    if(!ring.push(evt)) n_dropped.fetch_add(1, memory_order_relaxed);
+}
+
+bool motor_events::pop(motor_event &evt, double now){
+    if(!ring.pop(evt)) return false;
+    latency_hist.add((now - evt.t_ms) * 1000);
+    return true;
+}
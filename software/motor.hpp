@@ -0,0 +1,386 @@
+#pragma once
+
+/******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "algo.hpp"
+#include "lockfree.hpp"
+#include "physical_params.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
+#include "timing.hpp"
+
+using namespace std;
+
+/******************************************************************************
+ * Constants
+ ******************************************************************************/
+
+// Speeds set on every axis at startup
+const int init_vel_lin_cm_s = 100;
+const int init_accel_lin_cm_ss = 1000;
+
+const int init_vel_rot_deg_s = 5000;
+const int init_accel_rot_deg_ss = 50000;
+
+const int homing_timeout_ms = 10000;
+
+// Default rate the motor thread reads every axis at, --mtr-rate
+const double default_sample_hz = 500;
+
+// Motion events, cm or deg and s. Within done_tol of the target and slower
+// than still_vel is done
+const double done_tol[num_axis_t] = {0.1, 1.0};
+const double still_vel[num_axis_t] = {1, 20};
+// Window measured velocity is taken over
+const double still_window_ms = 4;
+// Further than this off the profile as issued is a tracking error
+const double follow_err_max[num_axis_t] = {1, 10};
+// Not moving, not at the target, for this long is a stall
+const double stall_ms = 50;
+// Velocity moves run until told otherwise, so they're stopped if the control
+// loop hasn't posted for this long
+const double vel_watchdog_ms = 4 * track_period_ms;
+
+// Simulated ClearPath. Rough numbers for our motors, cm or deg and s
+const double sim_max_vel[num_axis_t] = {400, 30000};
+// At 100% torque, lower torque limits scale this down
+const double sim_max_accel[num_axis_t] = {8000, 400000};
+// Each call blocks this long, like a round trip over the SC hub's serial link
+const double sim_cmd_latency_ms = 0.4;
+
+// Most SC hub ports we'll drive at once, one I/O thread each
+const int max_motor_ports = 4;
+// Every axis of every rod
+const int num_motors = (int)num_axis_t * num_rod_t;
+
+/******************************************************************************
+ * Backends
+ ******************************************************************************/
+
+/**
+ * Thrown by backends when a motor command fails
+ */
+struct motor_error : runtime_error {
+    using runtime_error::runtime_error;
+};
+
+/**
+ * Everything the motor thread needs from the motors, in cm for linear axes and
+ * deg for rotational ones. Only the motor thread should call these
+ */
+struct motor_backend {
+    virtual ~motor_backend() {}
+
+    // Find, enable and home everything, negative on failure. Adds how long
+    // each part took to phases
+    virtual int init(phase_log &phases) = 0;
+    virtual void close() = 0;
+
+    virtual void move(int axis, int rod, double pos) = 0;
+    // Run at vel until told otherwise
+    virtual void move_vel(int axis, int rod, double vel) = 0;
+    virtual void set_speed(int axis, int rod, double vel, double accel) = 0;
+    virtual void set_torque(int axis, int rod, double pct) = 0;
+    virtual void stop(int axis, int rod) = 0;
+    virtual double read_pos(int axis, int rod) = 0;
+
+    /**
+     * Which port (serial link) each axis is on. Calls for axes on different
+     * ports may be made from different threads at the same time, calls for
+     * one port are only ever made from one thread at a time
+     */
+    virtual int num_ports() { return 1; }
+    virtual int port(int /*axis*/, int /*rod*/) { return 0; }
+};
+
+/**
+ * ClearPath motors through sFoundation and the SC hub, only available when
+ * built with HAVE_SFOUNDATION. See motor_sfnd.cpp
+ */
+motor_backend *make_sfnd_backend();
+
+/**
+ * One simulated axis. Trapezoidal moves to target within the velocity and
+ * acceleration limits, with acceleration also capped by the torque limit
+ */
+struct sim_axis : trapezoid {
+    double torque = 100; // %
+    double max_accel = 0; // At full torque
+
+    double accel() const;
+    // Advance dt seconds
+    void step(double dt) { trapezoid::step(dt, accel()); }
+};
+
+/**
+ * Stand-in for the real motors so the whole control stack runs without the
+ * hub. Each axis is integrated lazily up to the time of each call on it, and
+ * every call blocks for its port's latency like a serial round trip. Axes are
+ * split over n_ports in order, so with two ports lin-* and rot-* are separate
+ */
+struct sim_backend : motor_backend {
+    sim_axis axes[num_axis_t][num_rod_t];
+    double t_last_ms[num_axis_t][num_rod_t];
+    int n_ports;
+    double port_latency_ms[max_motor_ports];
+
+    sim_backend(int n_ports = 1, double latency_ms = sim_cmd_latency_ms);
+
+    int init(phase_log &phases) override;
+    void close() override {}
+
+    void move(int axis, int rod, double pos) override;
+    void move_vel(int axis, int rod, double vel) override;
+    void set_speed(int axis, int rod, double vel, double accel) override;
+    void set_torque(int axis, int rod, double pct) override;
+    void stop(int axis, int rod) override;
+    double read_pos(int axis, int rod) override;
+
+    int num_ports() override { return n_ports; }
+    int port(int axis, int rod) override { return (axis*num_rod_t + rod) * n_ports / num_motors; }
+
+    // Blocks for the port's latency then brings the axis up to now
+    void sync(int axis, int rod);
+};
+
+/******************************************************************************
+ * Position sampling
+ ******************************************************************************/
+
+/**
+ * How well the motor thread is keeping up with reading every axis. Written by
+ * the motor thread, read for display
+ */
+struct sample_stats {
+    // Time per read_pos and per full sweep of all axes, us
+    histogram<500> read_hist{2};
+    histogram<500> sweep_hist{20};
+    // Sweeps that took longer than the sample period
+    atomic<long> n_sweeps{0}, n_overruns{0};
+};
+
+/******************************************************************************
+ * Command dispatcher
+ ******************************************************************************/
+
+typedef enum motor_op_t {
+    op_move,    // a: position
+    op_vel,     // a: velocity, velocity mode
+    op_speed,   // a: velocity, b: acceleration
+    op_torque,  // a: global torque limit, %
+    op_stop,    // Abrupt stop
+    op_query,   // Refresh measured position now
+    num_motor_op_t
+} motor_op_t;
+
+/**
+ * One command for one axis, what goes through the ring
+ */
+struct motor_op {
+    motor_op_t type;
+    int axis, rod;
+    double a, b;
+    chrono::steady_clock::time_point t_post;
+};
+
+// Ops the motor thread handles per wakeup
+const int max_motor_ops = 64;
+
+/**
+ * The one channel from the control loop to the motor thread. Everything goes
+ * through a single SPSC ring of typed ops, so a torque change and the move
+ * after it arrive in the order they were made. The control loop still just
+ * posts its full command set every tick, only changed axes turn into ops.
+ *
+ * The ring is lock free. The mutex/condition variable are only for putting the
+ * motor thread to sleep when it's idle, the producer only touches them when
+ * the consumer is actually asleep.
+ */
+struct motor_dispatcher {
+    typedef chrono::steady_clock clock;
+
+    spsc_ring<motor_op, 256> ring;
+    // Control loop only, what's been successfully queued so far
+    motor_cmds posted;
+
+    mutex m;
+    condition_variable cv;
+    atomic<bool> sleeping{false};
+
+    // Post to issue latency, us
+    histogram<500> latency_hist{2};
+    atomic<long> n_posts{0}, n_ops{0}, n_overflows{0}, n_coalesced{0}, n_wakeups{0};
+    atomic<long> n_issued[num_motor_op_t] = {};
+    // now_ms() of the last post, and velocity moves the motor thread stopped
+    // because it got stale
+    atomic<double> t_last_post{0};
+    atomic<long> n_vel_timeouts{0};
+    // Control loop only, n_vel_timeouts as of the last post
+    long vel_timeouts_seen = 0;
+    // Control loop only. Torque/stop/query that didn't fit in the ring, oldest
+    // first. Unlike moves nothing would send them again, so they're held here
+    // and go out ahead of anything queued after them
+    motor_op pending[max_motor_ops];
+    int n_pending = 0;
+
+    motor_dispatcher(const motor_cmds &init) : posted(init) {}
+
+    /**
+     * Control loop side. Queues move/velocity/speed ops for axes whose command
+     * changed since the last post. Axes that didn't fit are retried next post,
+     * as is the whole post if held torque/stop/query ops still don't fit.
+     * Leaving velocity mode always sends the move, or a zero velocity if
+     * there's no position to go to. After a velocity watchdog stop, velocity
+     * commands are sent again even if unchanged
+     */
+    void post(const motor_cmds &cmds);
+
+    // Control loop side, discrete commands. Held until there's room if the
+    // ring is full
+    void torque(int axis, int rod, double pct);
+    void stop(int axis, int rod);
+    void query(int axis, int rod);
+
+    /**
+     * Motor thread side. Waits until something is queued or timeout_ms passes,
+     * then drains up to max_motor_ops ops into ops. Moves and speed changes
+     * that were superseded by a later one for the same axis are dropped.
+     * Returns the number of ops
+     */
+    int wait(motor_op ops[max_motor_ops], double timeout_ms);
+
+    /**
+     * Motor thread side, call right before issuing op
+     */
+    void issued(const motor_op &op);
+
+    // Push and wake the motor thread
+    bool push(const motor_op &op);
+    void wake();
+    // Push or hold a torque/stop/query. A held op replaces an older held one
+    // of the same type for the same axis, which is why pending can't fill up
+    void push_once(const motor_op &op);
+    // Pushes held ops until the ring fills, returns whether they all went
+    bool flush_pending();
+};
+
+/******************************************************************************
+ * Port I/O
+ ******************************************************************************/
+
+/**
+ * One backend call and what came of it
+ */
+struct motor_io {
+    motor_op op;
+    double pos; // op_query result
+    double t_start, t_end; // now_ms() around the call
+    bool ok;
+    string err;
+};
+
+/**
+ * Runs a batch of backend calls with one thread per port, so axes on
+ * different SC hubs are talked to in parallel. The caller does port 0 itself
+ * and waits for the rest. With a single port everything stays on the calling
+ * thread
+ */
+struct port_pool {
+    struct worker {
+        thread th;
+        vector<motor_io*> jobs;
+        atomic<uint32_t> go{0};
+    };
+
+    motor_backend *motors;
+    int n_ports;
+    worker workers[max_motor_ports];
+    atomic<int> pending{0};
+    atomic<bool> quit{false};
+
+    // on_start runs first thing on each worker with its port, e.g. to name and
+    // place the thread
+    port_pool(motor_backend *motors, function<void(int)> on_start = nullptr);
+    ~port_pool();
+
+    void run(motor_io *ios, int n);
+    // Does the backend call for one io
+    void exec(motor_io &io);
+};
+
+/******************************************************************************
+ * Motion events
+ ******************************************************************************/
+
+typedef enum motor_evt_t {
+    evt_done,       // Got to target and stopped
+    evt_follow_err, // Off the profile it was sent by more than follow_err_max
+    evt_stall,      // Stopped short of target, blocked or out of torque
+    num_motor_evt_t
+} motor_evt_t;
+
+/**
+ * Something one axis did, found by the motor thread from its position samples
+ */
+struct motor_event {
+    motor_evt_t type;
+    int axis, rod;
+    double t_ms; // Sample the event was seen in, now_ms()
+    double pos, target;
+    long move; // motor_state::n_moves when the move was issued
+};
+
+/**
+ * Motor thread side. Watches every axis's samples against what it was sent
+ * and reports each event once per move
+ */
+struct motion_monitor {
+    struct watch {
+        bool moving = false, follow_err = false, stalled = false;
+        axis_profile issued; // Profile as of the move, never corrected
+        double target = NAN;
+        long move = 0;
+        double t_still = NAN; // Since when it's been stopped short
+    };
+    watch w[num_axis_t][num_rod_t];
+
+    // A move (or anything that replaces one) was just issued
+    void moved(int axis, int rod, const axis_profile &prof, double target, long move);
+    // Velocity mode or stop, nothing to complete
+    void idle(int axis, int rod);
+
+    /**
+     * Checks the axis after a new sample, returns the number of events
+     * written to out
+     */
+    int check(int axis, int rod, const motor_state &mtr, motor_event out[num_motor_evt_t]);
+};
+
+/**
+ * Motor thread to control loop. Events also carry how long they took to get
+ * across, from the sample that showed them to being read
+ */
+struct motor_events {
+    spsc_ring<motor_event, 256> ring;
+    histogram<500> latency_hist{20}; // us
+    atomic<long> n_events[num_motor_evt_t] = {};
+    atomic<long> n_dropped{0};
+
+    void push(const motor_event &evt);
+    // Control loop side, false when empty
+    bool pop(motor_event &evt, double now);
+};
+
@@ -0,0 +1,313 @@
+#include "motor.hpp"
+#include "timing.hpp"
+#include <clearpath/pubMotion.h>
+#include <clearpath/pubSysCls.h>
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+#define ever ;;
+
+/******************************************************************************
+ * Global Variables
+ ******************************************************************************/
+
+// Might not want these to be global later, whatever for now
+sFnd::SysManager mgr;
+vector<reference_wrapper<sFnd::INode>> nodes[num_axis_t];
+// Port index each node was found on
+int node_port[num_axis_t][num_rod_t];
+size_t port_count = 0;
+
+motor_error to_motor_error(const sFnd::mnErr &err){
+    char msg[512];
+    snprintf(msg, sizeof(msg), "addr=%d, err=0x%08x, msg=%s", err.TheAddr, err.ErrorCode, err.ErrorMsg);
+    return motor_error(msg);
+}
+
+/******************************************************************************
+ * Motor Wrappers
+ ******************************************************************************/
+
+
+void move_lin(int rod, double position_cm){
+    /* if(rod != three_bar) return; */
+    int target_cnts = clamp(
+            (int)(-lin_cm_to_cnts[rod] * position_cm),
+            min(lin_range_cnts[rod][0], lin_range_cnts[rod][1]),
+            max(lin_range_cnts[rod][0], lin_range_cnts[rod][1])
+    );
+    nodes[lin][rod].get().Motion.MovePosnStart(target_cnts, true);
+}
+
+void move_rot(int rod, double position_deg){
+    /* if(rod != three_bar) return; */
+    int target_cnts = rot_deg_to_cnts[rod] * (position_deg - cal_rot);
+    nodes[rot][rod].get().Motion.MovePosnStart(target_cnts, true);
+}
+
+function<void(int, double)> mtr_move[num_axis_t] = {move_lin, move_rot};
+
+void set_speed_lin(int rod, double vel_cm_per_s, double acc_cm_per_s2){
+    nodes[lin][rod].get().Motion.VelLimit = abs(vel_cm_per_s * lin_cm_to_cnts[rod]);
+    nodes[lin][rod].get().Motion.AccLimit = abs(acc_cm_per_s2 * lin_cm_to_cnts[rod]);
+}
+
+void set_speed_rot(int rod, double vel_deg_per_s, double acc_deg_per_s2){
+    nodes[rot][rod].get().Motion.VelLimit = vel_deg_per_s * rot_deg_to_cnts[rod];
+    nodes[rot][rod].get().Motion.AccLimit = acc_deg_per_s2 * rot_deg_to_cnts[rod];
+}
+
+function<void(int, double, double)> mtr_set_speed[num_axis_t] = {set_speed_lin, set_speed_rot};
+
+void close_all(){
+    for(size_t p = 0; p < port_count; ++p){
+        sFnd::IPort &port = mgr.Ports(p);
+        for(int i = 0; i < port.NodeCount(); ++i){
+            port.Nodes(i).EnableReq(false);
+        }
+    }
+    mgr.PortsClose();
+}
+
+/**
+ * Polls done every ms until it returns true or timeout_ms passes. Returns
+ * whether it finished. Sleeping between polls leaves the CPU to everything
+ * else that's starting up
+ */
+bool wait_until(double timeout_ms, const function<bool()> &done){
+    double timeout = now_ms() + timeout_ms;
+    for(ever){
+        if(done()) return true;
+        if(now_ms() > timeout) return false;
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+}
+
+/**
+ * Units, limits and refresh for one node, after it's enabled and homed
+ */
+void configure_node(int axis, int rod){
+    sFnd::INode &node = nodes[axis][rod].get();
+    node.AccUnit(sFnd::INode::COUNTS_PER_SEC2);
+    node.VelUnit(sFnd::INode::COUNTS_PER_SEC);
+    node.Limits.TrqGlobal = 100;
+    if(axis == lin || rod != goalie)
+        node.Info.Ex.Parameter(98,1);
+    node.Motion.PosnMeasured.AutoRefresh(true);
+    if(axis == lin){
+        // Same range move_lin clamps to, so the drive also stops a velocity
+        // move there. Only enforced once homed and with software limits
+        // turned on in the node's ClearView config
+        node.Limits.SoftLimit1 = min(lin_range_cnts[rod][0], lin_range_cnts[rod][1]);
+        node.Limits.SoftLimit2 = max(lin_range_cnts[rod][0], lin_range_cnts[rod][1]);
+        set_speed_lin(rod, init_vel_lin_cm_s, init_accel_lin_cm_ss);
+    } else {
+        set_speed_rot(rod, init_vel_rot_deg_s, init_accel_rot_deg_ss);
+    }
+}
+
+int motors_init(phase_log &phases){
+    double t_start = now_ms();
+    vector<string> comHubPorts;
+
+    // Identify hubs
+    sFnd::SysManager::FindComHubPorts(comHubPorts);
+    printf("Found %zu SC Hubs\n", comHubPorts.size());
+
+    // Find available ports
+    for (port_count = 0; port_count < comHubPorts.size() && port_count < (size_t)min(NET_CONTROLLER_MAX, max_motor_ports); port_count++) {
+        mgr.ComHubPort(port_count, comHubPorts[port_count].c_str(), MN_BAUD_48X);
+    }
+
+    if (port_count == 0) {
+        printf("Unable to locate SC hub port\n");
+        return -1;
+    }
+
+    // Open ports (hubs)
+    mgr.PortsOpen(port_count);
+
+    for(size_t p = 0; p < port_count; ++p){
+        sFnd::IPort &port = mgr.Ports(p);
+        printf(" Port[%d]: state=%d, nodes=%d\n",
+            port.NetNumber(), port.OpenState(), port.NodeCount());
+    }
+
+    // Arrange nodes, they can be on any hub and are found by UserID
+    for(int i = 0; i < num_rod_t; ++i){
+        string lin_name = "lin-" + rod_names[i];
+        string rot_name = "rot-" + rod_names[i];
+        bool lin_found = false, rot_found = false;
+
+        // Search to find correct names
+        for(size_t p = 0; p < port_count; ++p){
+            sFnd::IPort &port = mgr.Ports(p);
+            for(int j = 0; j < port.NodeCount(); ++j){
+                string name = port.Nodes(j).Info.UserID.Value();
+                if(!lin_found && lin_name == name){
+                    nodes[lin].push_back(port.Nodes(j));
+                    node_port[lin][i] = p;
+                    lin_found = true;
+                }
+                if(!rot_found && rot_name == name){
+                    nodes[rot].push_back(port.Nodes(j));
+                    node_port[rot][i] = p;
+                    rot_found = true;
+                }
+            }
+        }
+        if(!lin_found || !rot_found){
+            printf("Not all motors are present!\n");
+            return -1;
+        }
+    }
+
+    phases.add("find and open hubs", t_start, now_ms());
+
+    // Each port brings up its own nodes on its own thread. Rotational axes
+    // don't home, so they're configured while the linear ones are homing, and
+    // each linear axis is configured as soon as it's homed
+    atomic<bool> failed{false};
+    vector<thread> port_threads;
+    for(size_t p = 0; p < port_count; ++p){
+        port_threads.emplace_back([p, &failed, &phases](){
+            // Errors have to be caught here, they can't leave the thread
+            try{
+                string tag = " (port " + to_string(p) + ")";
+                vector<pair<int, int>> mine; // axis, rod
+                for(int a = 0; a < num_axis_t; ++a)
+                    for(int r = 0; r < num_rod_t; ++r)
+                        if(node_port[a][r] == (int)p) mine.push_back({a, r});
+
+                double t = now_ms();
+                for(auto [a, r] : mine){
+                    sFnd::INode &node = nodes[a][r].get();
+                    node.Status.AlertsClear();
+                    node.Motion.NodeStopClear();
+                    node.EnableReq(true);
+                }
+                // Wait for enable
+                bool ok = wait_until(2000, [&](){
+                    for(auto [a, r] : mine)
+                        if(!nodes[a][r].get().Motion.IsReady()) return false;
+                    return true;
+                });
+                phases.add("enable" + tag, t, now_ms());
+                if(!ok){
+                    printf("Timed out waiting for Nodes to enable%s\n", tag.c_str());
+                    failed = true;
+                    return;
+                }
+
+                // Start homing
+                t = now_ms();
+                bool configured[num_axis_t][num_rod_t] = {};
+                for(auto [a, r] : mine){
+                    sFnd::INode &node = nodes[a][r].get();
+                    if(a != lin || !node.Motion.Homing.HomingValid()) continue;
+                    if(!node.Motion.Homing.WasHomed()) node.Motion.Homing.Initiate();
+                }
+
+                // Configure whatever's ready while the rest home
+                ok = wait_until(homing_timeout_ms, [&](){
+                    bool done = true;
+                    for(auto [a, r] : mine){
+                        if(configured[a][r]) continue;
+                        sFnd::INode &node = nodes[a][r].get();
+                        if(a == lin && node.Motion.Homing.HomingValid() && !node.Motion.Homing.WasHomed()){
+                            done = false;
+                            continue;
+                        }
+                        configure_node(a, r);
+                        configured[a][r] = true;
+                    }
+                    return done;
+                });
+                phases.add("home and configure" + tag, t, now_ms());
+                if(!ok){
+                    cout << "Homing timed out" << tag << endl;
+                    failed = true;
+                }
+            } catch(sFnd::mnErr &err){
+                printf("Caught error bringing up port %zu: %s\n", p, to_motor_error(err).what());
+                failed = true;
+            }
+        });
+    }
+    for(thread &th : port_threads) th.join();
+
+    if(failed){
+        close_all();
+        return -1;
+    }
+    return 0;
+}
+
+/******************************************************************************
+ * Backend
+ ******************************************************************************/
+
+struct sfnd_backend : motor_backend {
+    int init(phase_log &phases) override {
+        try{
+            return motors_init(phases);
+        } catch(sFnd::mnErr &err){
+            printf("Caught error initializing motors: %s\n", to_motor_error(err).what());
+            return -1;
+        }
+    }
+
+    void close() override {
+        close_all();
+    }
+
+    void move(int axis, int rod, double pos) override {
+        try{ mtr_move[axis](rod, pos); }
+        catch(sFnd::mnErr &err){ throw to_motor_error(err); }
+    }
+
+    void move_vel(int axis, int rod, double vel) override {
+        // Same sign conventions as move_lin/move_rot
+        double cnts_per_s = axis == lin ? -lin_cm_to_cnts[rod] * vel : rot_deg_to_cnts[rod] * vel;
+        try{ nodes[axis][rod].get().Motion.MoveVelStart(cnts_per_s); }
+        catch(sFnd::mnErr &err){ throw to_motor_error(err); }
+    }
+
+    void set_speed(int axis, int rod, double vel, double accel) override {
+        try{ mtr_set_speed[axis](rod, vel, accel); }
+        catch(sFnd::mnErr &err){ throw to_motor_error(err); }
+    }
+
+    void set_torque(int axis, int rod, double pct) override {
+        try{ nodes[axis][rod].get().Limits.TrqGlobal = pct; }
+        catch(sFnd::mnErr &err){ throw to_motor_error(err); }
+    }
+
+    void stop(int axis, int rod) override {
+        try{ nodes[axis][rod].get().Motion.NodeStop(STOP_TYPE_ABRUPT); }
+        catch(sFnd::mnErr &err){ throw to_motor_error(err); }
+    }
+
+    // Each port is its own serial link, sFoundation is fine with one thread
+    // per port as long as a port is only used from one thread at a time
+    int num_ports() override { return port_count; }
+    int port(int axis, int rod) override { return node_port[axis][rod]; }
+
+    double read_pos(int axis, int rod) override {
+        try{
+            if(axis == lin){
+                return abs(nodes[lin][rod].get().Motion.PosnMeasured.Value() / lin_cm_to_cnts[rod]);
+            }
+            return nodes[rot][rod].get().Motion.PosnMeasured.Value() / rot_rad_to_cnts[rod] / deg_to_rad + cal_rot;
+        } catch(sFnd::mnErr &err){ throw to_motor_error(err); }
+    }
+};
+
+motor_backend *make_sfnd_backend(){
+    return new sfnd_backend();
+}
@@ -0,0 +1,91 @@
+#include "motor.hpp"
+#include "timing.hpp"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+using namespace std;
+
+/******************************************************************************
+ * Simulated axis
+ ******************************************************************************/
+
+double sim_axis::accel() const {
+    return min(amax, max_accel * clamp(torque, 0.0, 100.0) / 100);
+}
+
+/******************************************************************************
+ * Simulated backend
+ ******************************************************************************/
+
+sim_backend::sim_backend(int n_ports, double latency_ms) : n_ports(clamp(n_ports, 1, max_motor_ports)) {
+    for(int p = 0; p < max_motor_ports; ++p) port_latency_ms[p] = latency_ms;
+}
+
+int sim_backend::init(phase_log &phases){
+    double t_start = now_ms();
+    for(int a = 0; a < num_axis_t; ++a){
+        for(int r = 0; r < num_rod_t; ++r){
+            sim_axis &ax = axes[a][r];
+            ax = sim_axis();
+            ax.max_accel = sim_max_accel[a];
+            ax.vmax = a == lin ? init_vel_lin_cm_s : init_vel_rot_deg_s;
+            ax.amax = a == lin ? init_accel_lin_cm_ss : init_accel_rot_deg_ss;
+            t_last_ms[a][r] = now_ms();
+        }
+    }
+    printf("Using simulated motors, %d port(s), %.1fms per command\n", n_ports, port_latency_ms[0]);
+    phases.add("simulated motors", t_start, now_ms());
+    return 0;
+}
+
+void sim_backend::sync(int axis, int rod){
+    double latency_ms = port_latency_ms[port(axis, rod)];
+    if(latency_ms > 0) this_thread::sleep_for(chrono::duration<double, milli>(latency_ms));
+    double t = now_ms();
+    sim_axis &ax = axes[axis][rod];
+    ax.step((t - t_last_ms[axis][rod]) / 1000);
+    t_last_ms[axis][rod] = t;
+    // Velocity mode can run a linear axis into the end of its travel
+    if(axis == lin && (ax.pos < 0 || ax.pos > lin_range_cm[rod])){
+        ax.pos = clamp(ax.pos, 0.0, lin_range_cm[rod]);
+        ax.vel = 0;
+    }
+}
+
+void sim_backend::move(int axis, int rod, double pos){
+    sync(axis, rod);
+    // Linear axes are clamped to the rod's range like move_lin
+    axes[axis][rod].target = axis == lin ? clamp(pos, 0.0, lin_range_cm[rod]) : pos;
+    axes[axis][rod].vel_mode = false;
+}
+
+void sim_backend::move_vel(int axis, int rod, double vel){
+    sync(axis, rod);
+    axes[axis][rod].vel_mode = true;
+    axes[axis][rod].vel_target = clamp(vel, -sim_max_vel[axis], sim_max_vel[axis]);
+}
+
+void sim_backend::set_speed(int axis, int rod, double vel, double accel){
+    sync(axis, rod);
+    axes[axis][rod].vmax = min(abs(vel), sim_max_vel[axis]);
+    axes[axis][rod].amax = abs(accel);
+}
+
+void sim_backend::set_torque(int axis, int rod, double pct){
+    sync(axis, rod);
+    axes[axis][rod].torque = pct;
+}
+
+void sim_backend::stop(int axis, int rod){
+    sync(axis, rod);
+    sim_axis &ax = axes[axis][rod];
+    ax.vel = 0;
+    ax.target = ax.pos;
+    ax.vel_mode = false;
+}
+
+double sim_backend::read_pos(int axis, int rod){
+    sync(axis, rod);
+    return axes[axis][rod].pos;
+}
@@ -0,0 +1,217 @@
+#include "profile.hpp"
+#include <algorithm>
+
+using namespace std;
+
+/******************************************************************************
+ * Trapezoidal profile
+ ******************************************************************************/
+
+bool trapezoid::phase(double a, double &acc, double &t_phase) const {
+    if(a <= 0) return false;
+    if(vel_mode){
+        // Ramp to the commanded velocity then hold it forever
+        double dv = vel_target - vel;
+        acc = abs(dv) < 1e-9 ? 0 : (dv > 0 ? a : -a);
+        t_phase = acc == 0 ? INFINITY : abs(dv) / a;
+        return true;
+    }
+    double d = target - pos;
+    if(abs(d) < 1e-9 && abs(vel) < 1e-6) return false;
+    double dir = d >= 0 ? 1 : -1;
+    double v = vel * dir; // Speed towards target
+    double stop_dist = v*v / (2*a);
+    // Time until we'd have to start braking if we kept accelerating
+    double t_brake = (sqrt(a*abs(d) + v*v/2) - v) / a;
+
+    if(v < 0){
+        // Going the wrong way, turn around
+        acc = dir*a;
+        t_phase = -v / a;
+    } else if(stop_dist >= abs(d) - 1e-9 || t_brake < 1e-9){
+        // Have to brake now, overshoots a little if we're late
+        acc = -dir*a;
+        t_phase = v / a;
+    } else if(v > vmax){
+        // Speed limit was lowered mid move
+        acc = -dir*a;
+        t_phase = (v - vmax) / a;
+    } else if(v < vmax){
+        // Speed up until the speed limit or until we have to brake
+        acc = dir*a;
+        t_phase = min((vmax - v) / a, t_brake);
+    } else {
+        // Cruise until we have to brake
+        acc = 0;
+        t_phase = (abs(d) - stop_dist) / vmax;
+    }
+    t_phase = max(t_phase, 0.0);
+    return true;
+}
+
+void trapezoid::step(double dt, double a){
+    // No torque, stays put
+    if(a <= 0) return;
+    // Each pass runs to the end of one phase, so only a few are ever needed.
+    // Capped in case of numerical trouble at the boundaries
+    for(int i = 0; i < trap_max_phases && dt > 0; ++i){
+        double acc, t_phase;
+        if(!phase(a, acc, t_phase)){
+            pos = target;
+            vel = 0;
+            return;
+        }
+        double h = min(dt, t_phase);
+        pos += vel*h + acc*h*h/2;
+        vel += acc*h;
+        dt -= h;
+        if(vel_mode){
+            if(h == t_phase) vel = vel_target;
+            continue;
+        }
+        // Braking phase finished on the target
+        if(h == t_phase && abs(target - pos) < 1e-6 && abs(vel) < 1e-6){
+            pos = target;
+            vel = 0;
+        }
+    }
+}
+
+double trapezoid::time_to_target(double a) const {
+    if(vel_mode) return INFINITY;
+    trapezoid tmp = *this;
+    double t = 0;
+    for(int i = 0; i < trap_max_phases; ++i){
+        double acc, t_phase;
+        if(!tmp.phase(a, acc, t_phase)) return t;
+        if(isinf(t_phase)) return INFINITY;
+        tmp.step(t_phase, a);
+        t += t_phase;
+    }
+    return abs(tmp.target - tmp.pos) < 1e-6 ? t : INFINITY;
+}
+
+double min_time(trapezoid tz, double target, double vmax, double a){
+    tz.target = target;
+    tz.vel_mode = false;
+    tz.vmax = vmax;
+    return tz.time_to_target(a);
+}
+
+double vel_for_time(trapezoid tz, double target, double t, double vmax, double a){
+    tz.target = target;
+    tz.vel_mode = false;
+    double t_min = min_time(tz, target, vmax, a);
+    if(t_min > t + 1e-6) return NAN;
+    // Already there, leave the limit where it was asked
+    if(t_min == 0) return vmax;
+    // Time to target only goes down as the speed limit goes up, so bisect
+    double lo = 0, hi = vmax;
+    for(int i = 0; i < 50; ++i){
+        tz.vmax = (lo + hi) / 2;
+        if(tz.time_to_target(a) > t) lo = tz.vmax;
+        else hi = tz.vmax;
+    }
+    return hi;
+}
+
+/******************************************************************************
+ * Axis predictor
+ ******************************************************************************/
+
+void axis_profile::advance(double now){
+    if(now > t_ms) tz.step((now - t_ms) / 1000);
+    t_ms = max(t_ms, now);
+}
+
+void axis_profile::move(double now, double target){
+    advance(now);
+    tz.target = target;
+    tz.vel_mode = false;
+    err_max = 0;
+}
+
+void axis_profile::move_vel(double now, double vel){
+    advance(now);
+    tz.vel_mode = true;
+    tz.vel_target = vel;
+}
+
+void axis_profile::limits(double now, double vel, double accel){
+    advance(now);
+    tz.vmax = abs(vel);
+    tz.amax = abs(accel);
+}
+
+void axis_profile::stop(double now){
+    advance(now);
+    tz.vel = 0;
+    tz.target = tz.pos;
+    tz.vel_mode = false;
+}
+
+void axis_profile::measured(double now, double pos){
+    advance(now);
+    err = pos - tz.pos;
+    err_max = max(err_max, abs(err));
+    tz.pos = pos;
+    // Already there as far as the motor is concerned, don't keep predicting
+    // a crawl over the last fraction of a count
+    if(!tz.vel_mode && abs(tz.target - pos) < 1e-6) tz.vel = 0;
+}
+
+double axis_profile::pos_at(double t) const {
+    if(t <= t_ms) return tz.pos;
+    trapezoid tmp = tz;
+    tmp.step((t - t_ms) / 1000);
+    return tmp.pos;
+}
+
+double axis_profile::vel_at(double t) const {
+    if(t <= t_ms) return tz.vel;
+    trapezoid tmp = tz;
+    tmp.step((t - t_ms) / 1000);
+    return tmp.vel;
+}
+
+double axis_profile::arrival_ms() const {
+    return t_ms + tz.time_to_target() * 1000;
+}
+
+/******************************************************************************
+ * Position history
+ ******************************************************************************/
+
+void pos_series::add(double t_ms, double pos){
+    samples[head] = {t_ms, pos};
+    head = (head + 1) % pos_series_len;
+    n = min(n + 1, pos_series_len);
+}
+
+double pos_series::at(double t) const {
+    if(n == 0) return NAN;
+    if(t >= get(0).t_ms) return get(0).pos;
+    for(int i = 1; i < n; ++i){
+        const pos_sample &a = get(i), &b = get(i - 1);
+        if(t < a.t_ms) continue;
+        if(b.t_ms - a.t_ms <= 0) return b.pos;
+        return a.pos + (b.pos - a.pos) * (t - a.t_ms) / (b.t_ms - a.t_ms);
+    }
+    return get(n - 1).pos;
+}
+
+double pos_series::rate_hz() const {
+    if(n < 2) return 0;
+    double span = get(0).t_ms - get(n - 1).t_ms;
+    return span > 0 ? (n - 1) * 1000 / span : 0;
+}
+
+double pos_series::vel(double window_ms) const {
+    if(n < 2) return 0;
+    const pos_sample &b = get(0);
+    int i = 1;
+    while(i < n - 1 && b.t_ms - get(i).t_ms < window_ms) ++i;
+    const pos_sample &a = get(i);
+    return b.t_ms > a.t_ms ? (b.pos - a.pos) * 1000 / (b.t_ms - a.t_ms) : 0;
+}
+
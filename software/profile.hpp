@@ -0,0 +1,135 @@
+#pragma once
+
+/******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <cmath>
+
+using namespace std;
+
+/******************************************************************************
+ * Constants
+ ******************************************************************************/
+
+// Phases of a trapezoid are at most turn around, speed up, cruise, brake, plus
+// slack for the boundaries
+const int trap_max_phases = 8;
+
+// Measured positions kept per axis, about 60ms at 500Hz
+const int pos_series_len = 32;
+
+/******************************************************************************
+ * Trapezoidal profile
+ ******************************************************************************/
+
+/**
+ * Trapezoidal move to target within vmax and an acceleration limit, starting
+ * from whatever velocity the axis already has. In velocity mode it instead
+ * ramps to vel_target and holds it. Same units as the caller, cm or deg and s.
+ * Plain data so it can go through a seqlock
+ */
+struct trapezoid {
+    double pos = 0, vel = 0, target = 0;
+    double vmax = 0, amax = 0;
+    bool vel_mode = false;
+    double vel_target = 0;
+
+    /**
+     * Acceleration and duration of the phase the axis is currently in, given
+     * the acceleration limit a. Returns false if it's sitting at the target
+     */
+    bool phase(double a, double &acc, double &t_phase) const;
+
+    // Advance dt seconds with acceleration limit a
+    void step(double dt, double a);
+    void step(double dt) { step(dt, amax); }
+
+    // Seconds until the axis is stopped at target, INFINITY if it never gets
+    // there or is in velocity mode
+    double time_to_target(double a) const;
+    double time_to_target() const { return time_to_target(amax); }
+};
+
+/**
+ * Shortest time (s) for tz to get to target within vmax and a, starting from
+ * where it is and how fast it's going
+ */
+double min_time(trapezoid tz, double target, double vmax, double a);
+
+/**
+ * Velocity limit that gets tz to target in exactly t seconds at acceleration
+ * a. NAN if it can't make it in t even at vmax
+ */
+double vel_for_time(trapezoid tz, double target, double t, double vmax, double a);
+
+/******************************************************************************
+ * Axis predictor
+ ******************************************************************************/
+
+/**
+ * What the motor thread thinks one axis is doing. Rebased on every command and
+ * every position read, so predictions are only ever extrapolated from the last
+ * thing that happened. Times are now_ms()
+ */
+struct axis_profile {
+    trapezoid tz;
+    double t_ms = 0; // Time tz is valid at
+    double err = 0; // Measured minus predicted at the last read
+    double err_max = 0; // Largest |err| since the last move
+
+    // Bring the model up to now
+    void advance(double now);
+
+    // Called when a move/velocity move/speed/stop is issued at time now
+    void move(double now, double target);
+    void move_vel(double now, double vel);
+    void limits(double now, double vel, double accel);
+    void stop(double now);
+
+    // Position read back from the motor at time now, snaps to it
+    void measured(double now, double pos);
+
+    // Predicted position/velocity at time t, any time at or after t_ms
+    double pos_at(double t) const;
+    double vel_at(double t) const;
+    // Predicted time of arrival at the target
+    double arrival_ms() const;
+    bool arrived(double t) const { return t >= arrival_ms(); }
+};
+
+/******************************************************************************
+ * Position history
+ ******************************************************************************/
+
+struct pos_sample {
+    double t_ms, pos;
+};
+
+/**
+ * Last pos_series_len measured positions of one axis, oldest overwritten first
+ */
+struct pos_series {
+    pos_sample samples[pos_series_len];
+    int head = 0; // Next write
+    int n = 0;
+
+    void add(double t_ms, double pos);
+    // i = 0 is the newest
+    const pos_sample &get(int i) const { return samples[(head - 1 - i + pos_series_len) % pos_series_len]; }
+
+    /**
+     * Position at time t linearly interpolated between samples, held at the
+     * ends. NAN if there are no samples. For times past the newest sample use
+     * axis_profile::pos_at, which knows about commands since
+     */
+    double at(double t) const;
+
+    // Achieved sample rate over the history, Hz
+    double rate_hz() const;
+
+    // Measured velocity between the newest sample and one at least window_ms
+    // older, or the oldest there is. Units per s
+    double vel(double window_ms) const;
+};
+
@@ -0,0 +1,411 @@
+/*
+ * Stand-in for the QTM RT server, so foosbar can be run against recorded or
+ * synthetic marker data without the cameras.
+ *
+ * Speaks just enough of the RT protocol for CRTProtocol::Connect and
+ * StreamFrames (little endian, protocol 1.x): welcome message and version
+ * negotiation over TCP, then 3D no label data frames over UDP.
+ *
+ * Like the real server the TCP command port is base port + 1 for the little
+ * endian protocol, so with the default base port of 22222 this listens on
+ * 22223, which is where the SDK connects when given 22222.
+ *
+ * Usage:
+ *   qtm_replay --capture <file> [--speed <x>] [--loop]
+ *   qtm_replay --synthetic [--rate <hz>] [--speed <x>]
+ *   common: [--port <base port>] [--calibration <qtm.yml>]
+ *
+ * Synthetic markers go through the inverse of the same calibration foosbar
+ * loads, so pass the same --calibration to both
+ *
+ * Then run foosbar with --qtm 127.0.0.1
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "physical_params.hpp"
+#include "capture.hpp"
+
+using namespace std;
+using namespace std::chrono;
+
+/******************************************************************************
+ * Defines/const
+ ******************************************************************************/
+
+#define ever ;;
+
+// RT protocol packet types
+const uint32_t pkt_error = 0;
+const uint32_t pkt_command = 1;
+const uint32_t pkt_data = 3;
+
+// RT protocol component types
+const uint32_t comp_3d_no_labels = 2;
+
+const int default_base_port = 22222;
+
+/******************************************************************************
+ * Protocol
+ ******************************************************************************/
+
+bool send_all(int fd, const void *buf, size_t len){
+    const char *p = (const char*)buf;
+    while(len > 0){
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool recv_all(int fd, void *buf, size_t len){
+    char *p = (char*)buf;
+    while(len > 0){
+        ssize_t n = recv(fd, p, len, 0);
+        if(n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Strings are sent null terminated, size includes the 8 byte header
+bool send_string(int fd, uint32_t type, const string &str){
+    uint32_t header[2] = {(uint32_t)(8 + str.size() + 1), type};
+    return send_all(fd, header, sizeof(header)) && send_all(fd, str.c_str(), str.size() + 1);
+}
+
+bool recv_packet(int fd, uint32_t &type, string &body){
+    uint32_t header[2];
+    if(!recv_all(fd, header, sizeof(header))) return false;
+    if(header[0] < 8 || header[0] > 1 << 20) return false;
+    type = header[1];
+    body.resize(header[0] - 8);
+    if(!recv_all(fd, body.data(), body.size())) return false;
+    // Strip trailing null
+    while(!body.empty() && body.back() == '\0') body.pop_back();
+    return true;
+}
+
+void build_data_packet(vector<char> &buf, uint64_t qtm_us, uint32_t frame_number, const vector<capture_marker> &markers){
+    uint32_t comp_size = 8 + 8 + markers.size() * sizeof(capture_marker);
+    uint32_t size = 8 + 16 + comp_size;
+    buf.resize(size);
+    char *p = buf.data();
+    auto put = [&p](const void *v, size_t n){ memcpy(p, v, n); p += n; };
+
+    uint32_t type = pkt_data, n_comps = 1, n_markers = markers.size();
+    uint16_t drop_rate = 0, out_of_sync = 0;
+    put(&size, 4);
+    put(&type, 4);
+    put(&qtm_us, 8);
+    put(&frame_number, 4);
+    put(&n_comps, 4);
+    put(&comp_size, 4);
+    put(&comp_3d_no_labels, 4);
+    put(&n_markers, 4);
+    put(&drop_rate, 2);
+    put(&out_of_sync, 2);
+    put(markers.data(), markers.size() * sizeof(capture_marker));
+}
+
+/******************************************************************************
+ * Frame sources
+ ******************************************************************************/
+
+/**
+ * Ball rolling in straight lines that bounce off the side walls, with the hats
+ * of the human rods swinging back and forth. Ball occasionally stops so
+ * ball_in_motion gets exercised too, and some shots are jump shots that bounce
+ * a few times, with the marker jittering sideways while it's in the air
+ */
+struct synthetic_source {
+    mt19937 rng{1234};
+    double ball[3] = {play_height/2, 0, ball_rad};
+    double vel[3] = {0, 0, 0};
+    double t_stop_s = 0;
+    uint32_t frame = 0;
+    qtm_calibration cal;
+
+    void respawn(){
+        uniform_real_distribution<double> x(5, play_height-5), speed(50, 400), angle(-0.6, 0.6);
+        ball[0] = x(rng);
+        ball[1] = play_width/2 - 5;
+        double a = angle(rng), s = speed(rng);
+        vel[0] = s*sin(a);
+        vel[1] = -s*cos(a);
+        uniform_real_distribution<double> jump(0, 1), vz(60, 150);
+        vel[2] = jump(rng) < 0.3 ? vz(rng) : 0;
+    }
+
+    void next(double dt, double t_s, vector<capture_marker> &markers){
+        if(frame == 0) respawn();
+
+        if(t_s < t_stop_s){
+            // Sitting still
+        } else {
+            ball[0] += vel[0]*dt;
+            ball[1] += vel[1]*dt;
+            if(ball[0] < 0){ ball[0] = -ball[0]; vel[0] = -vel[0]; }
+            if(ball[0] > play_height){ ball[0] = 2*play_height - ball[0]; vel[0] = -vel[0]; }
+            if(ball[2] > ball_rad || vel[2] != 0){
+                const double g = 981;
+                ball[2] += vel[2]*dt - g*dt*dt/2;
+                vel[2] -= g*dt;
+                if(ball[2] < ball_rad){
+                    ball[2] = 2*ball_rad - ball[2];
+                    vel[2] = -0.5*vel[2];
+                    if(vel[2] < 20){ ball[2] = ball_rad; vel[2] = 0; }
+                }
+            }
+            if(abs(ball[1]) > play_width/2){
+                uniform_real_distribution<double> pause(0, 2);
+                t_stop_s = t_s + pause(rng);
+                respawn();
+            }
+        }
+
+        markers.clear();
+        double seen[3] = {ball[0], ball[1], ball[2]};
+        if(ball[2] > ball_rad + 0.5){
+            normal_distribution<double> jitter(0, 0.5);
+            seen[0] += jitter(rng);
+            seen[1] += jitter(rng);
+        }
+        markers.push_back(table_to_qtm(cal, seen, 0));
+        for(int r = 0; r < num_rod_t; ++r){
+            double rot = 30 * sin(t_s * (1 + r)) * deg_to_rad;
+            double lin = lin_range_cm[r]/2 * (1 + sin(t_s * (0.5 + 0.3*r)));
+            double hat[3] = {
+                lin + bumper_width + plr_width/2,
+                -rod_coord[r] + hat_height*sin(rot),
+                plr_height + hat_height*cos(rot),
+            };
+            markers.push_back(table_to_qtm(cal, hat, r + 1));
+        }
+        ++frame;
+    }
+};
+
+/******************************************************************************
+ * Main
+ ******************************************************************************/
+
+int main(int argc, char **argv){
+    string capture_path, calibration_path = "../assets/calibration/qtm.yml";
+    bool synthetic = false, loop = false;
+    double rate_hz = vision_fps, speed = 1;
+    int base_port = default_base_port;
+
+    for(int i = 1; i < argc; ++i){
+        string cmd(argv[i]);
+        bool has_arg = i + 1 < argc;
+        if(cmd == "--capture" && has_arg){
+            capture_path = argv[++i];
+        } else if(cmd == "--synthetic"){
+            synthetic = true;
+        } else if(cmd == "--rate" && has_arg){
+            rate_hz = stod(argv[++i]);
+        } else if(cmd == "--speed" && has_arg){
+            speed = stod(argv[++i]);
+        } else if(cmd == "--loop"){
+            loop = true;
+        } else if(cmd == "--port" && has_arg){
+            base_port = stoi(argv[++i]);
+        } else if(cmd == "--calibration" && has_arg){
+            // QTM to table transform, see assets/calibration/qtm.yml
+            calibration_path = argv[++i];
+        } else {
+            cout << "Unrecognized argument: " << cmd << endl;
+            return -1;
+        }
+    }
+    if(synthetic == !capture_path.empty() || rate_hz <= 0 || speed <= 0){
+        cout << "Need exactly one of --capture <file> or --synthetic, with positive rate/speed" << endl;
+        return -1;
+    }
+
+    qtm_calibration qtm_cal;
+    if(synthetic && !qtm_cal.load(calibration_path))
+        cout << "Couldn't load QTM calibration from " << calibration_path << ", using cal_offset" << endl;
+
+    capture_reader reader;
+    if(!synthetic && !reader.open(capture_path)){
+        cout << "Couldn't open capture " << capture_path << endl;
+        return -1;
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(base_port + 1);
+    if(bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0){
+        perror("Couldn't listen");
+        return -1;
+    }
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    cout << "Listening on port " << base_port + 1 << endl;
+
+    vector<char> packet;
+    capture_frame frame;
+
+    for(ever){
+        sockaddr_in client_addr = {};
+        socklen_t client_len = sizeof(client_addr);
+        int fd = accept(listen_fd, (sockaddr*)&client_addr, &client_len);
+        if(fd < 0) continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        cout << "Client connected from " << inet_ntoa(client_addr.sin_addr) << endl;
+
+        send_string(fd, pkt_command, "QTM RT Interface connected");
+
+        bool streaming = false, pending = false;
+        sockaddr_in udp_addr = client_addr;
+        synthetic_source synth;
+        synth.cal = qtm_cal;
+        steady_clock::time_point t_start, t_next, t_report;
+        uint64_t qtm_us0 = 0;
+        bool have_qtm_us0 = false;
+        // Added to capture frame numbers so they keep counting up across --loop
+        int64_t frame_shift = 0;
+        uint32_t last_frame = 0;
+        long n_sent = 0, n_late = 0;
+        double worst_late_us = 0;
+
+        for(ever){
+            // Wait for a command or for the next frame to be due
+            int timeout_ms = -1;
+            if(streaming){
+                auto dt = duration_cast<milliseconds>(t_next - steady_clock::now()).count();
+                timeout_ms = max(0, (int)dt - 1);
+            }
+            pollfd pfd = {fd, POLLIN, 0};
+            if(poll(&pfd, 1, timeout_ms) > 0){
+                uint32_t type;
+                string cmd;
+                if(!recv_packet(fd, type, cmd)) break;
+
+                if(cmd.rfind("Version ", 0) == 0){
+                    send_string(fd, pkt_command, "Version set to " + cmd.substr(8));
+                } else if(cmd == "ByteOrder"){
+                    send_string(fd, pkt_command, "Byte order is little endian");
+                } else if(cmd == "QTMVersion"){
+                    send_string(fd, pkt_command, "QTM Version is foosbar qtm_replay");
+                } else if(cmd.rfind("StreamFrames Stop", 0) == 0){
+                    streaming = false;
+                } else if(cmd.rfind("StreamFrames", 0) == 0){
+                    // Either UDP:port or UDP:address:port
+                    size_t udp = cmd.find("UDP:");
+                    if(udp == string::npos){
+                        send_string(fd, pkt_error, "Only UDP streaming is supported");
+                        continue;
+                    }
+                    string target = cmd.substr(udp + 4, cmd.find(' ', udp) - udp - 4);
+                    size_t colon = target.rfind(':');
+                    if(colon != string::npos){
+                        inet_aton(target.substr(0, colon).c_str(), &udp_addr.sin_addr);
+                        target = target.substr(colon + 1);
+                    }
+                    udp_addr.sin_port = htons(stoi(target));
+                    streaming = true;
+                    pending = false;
+                    t_start = t_next = t_report = steady_clock::now();
+                    reader.rewind();
+                    have_qtm_us0 = false;
+                    frame_shift = 0;
+                    cout << "Streaming to UDP port " << ntohs(udp_addr.sin_port) << endl;
+                } else if(cmd == "Disconnect"){
+                    break;
+                } else {
+                    send_string(fd, pkt_error, "Command not supported by qtm_replay");
+                }
+                continue;
+            }
+            if(!streaming) continue;
+
+            // Queue up the next frame and work out when it's due
+            if(!pending){
+                if(synthetic){
+                    double t_s = duration<double>(t_next - t_start).count() * speed;
+                    synth.next(speed / rate_hz, t_s, frame.markers);
+                    frame.frame_number = synth.frame;
+                } else {
+                    if(!reader.read(frame)){
+                        if(!loop){
+                            cout << "End of capture" << endl;
+                            streaming = false;
+                            continue;
+                        }
+                        reader.rewind();
+                        have_qtm_us0 = false;
+                        // Carry on one frame after the end, like one long capture
+                        t_start = t_next + duration_cast<steady_clock::duration>(duration<double>(1 / (vision_fps * speed)));
+                        if(!reader.read(frame)) break;
+                        frame_shift = (int64_t)last_frame + 1 - frame.frame_number;
+                    }
+                    frame.frame_number += frame_shift;
+                    if(!have_qtm_us0) qtm_us0 = frame.qtm_us;
+                    have_qtm_us0 = true;
+                    frame.qtm_us -= qtm_us0;
+                    // Pace from the capture's own clock so dropped frames stay dropped
+                    t_next = t_start + duration_cast<steady_clock::duration>(
+                            duration<double, micro>(frame.qtm_us / speed));
+                }
+                pending = true;
+                continue;
+            }
+
+            // Spin the last little bit, poll only has ms resolution
+            while(steady_clock::now() < t_next) this_thread::yield();
+            auto now = steady_clock::now();
+            double late_us = duration_cast<nanoseconds>(now - t_next).count() / 1000.0;
+            if(late_us > 1000) ++n_late;
+            worst_late_us = max(worst_late_us, late_us);
+            pending = false;
+            // Timestamp with when the frame was due rather than sent. That's
+            // the capture's clock scaled by --speed onto ours, so qtm_clock's
+            // offset and drift come out as on a live run, and scheduling
+            // jitter shows up as receive delay rather than capture jitter
+            uint64_t qtm_us = duration_cast<microseconds>(t_next.time_since_epoch()).count();
+            last_frame = frame.frame_number;
+            if(synthetic) t_next += duration_cast<steady_clock::duration>(duration<double>(1 / rate_hz));
+
+            build_data_packet(packet, qtm_us, frame.frame_number, frame.markers);
+            sendto(udp_fd, packet.data(), packet.size(), 0, (sockaddr*)&udp_addr, sizeof(udp_addr));
+            ++n_sent;
+
+            if(now - t_report > seconds(1)){
+                double elapsed = duration<double>(now - t_report).count();
+                printf("Sent %ld frames (%.1f Hz), %ld late by >1ms, worst %.0f us\n",
+                        n_sent, n_sent / elapsed, n_late, worst_late_us);
+                n_sent = n_late = 0;
+                worst_late_us = 0;
+                t_report = now;
+            }
+        }
+        cout << "Client disconnected" << endl;
+        close(fd);
+    }
+
+    return 0;
+}
+
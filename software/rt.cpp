@@ -0,0 +1,269 @@
+#include "rt.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace std;
+
+/******************************************************************************
+ * Helpers
+ ******************************************************************************/
+
+const long ns_per_s = 1000000000;
+
+void ts_add(timespec &t, long ns){
+    t.tv_nsec += ns;
+    while(t.tv_nsec >= ns_per_s){
+        t.tv_nsec -= ns_per_s;
+        ++t.tv_sec;
+    }
+}
+
+// a - b in ns
+long ts_diff(const timespec &a, const timespec &b){
+    return (a.tv_sec - b.tv_sec) * ns_per_s + (a.tv_nsec - b.tv_nsec);
+}
+
+/******************************************************************************
+ * Real-time setup
+ ******************************************************************************/
+
+bool lock_memory(){
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0){
+        printf("mlockall failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool set_fifo(int priority){
+    sched_param param = {};
+    param.sched_priority = priority;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if(err != 0){
+        printf("SCHED_FIFO priority %d failed: %s\n", priority, strerror(err));
+        return false;
+    }
+    return true;
+}
+
+/******************************************************************************
+ * Thread topology
+ ******************************************************************************/
+
+// Threads that went through apply_thread, for thread_report
+mutex registry_mutex;
+vector<pair<string, int>> registry;
+
+bool thread_topology::load(const string &path){
+    cv::FileStorage fs(path, cv::FileStorage::READ);
+    if(!fs.isOpened()){
+        printf("Couldn't open thread config %s\n", path.c_str());
+        return false;
+    }
+    map<string, thread_config> loaded;
+    cv::FileNode root = fs.root();
+    for(cv::FileNodeIterator it = root.begin(); it != root.end(); ++it){
+        cv::FileNode node = *it;
+        thread_config cfg;
+        for(cv::FileNodeIterator c = node["cpus"].begin(); c != node["cpus"].end(); ++c)
+            cfg.cpus.push_back((int)*c);
+        if(!node["policy"].empty()){
+            string policy = (string)node["policy"];
+            cfg.set_sched = true;
+            if(policy == "other") cfg.policy = SCHED_OTHER;
+            else if(policy == "fifo") cfg.policy = SCHED_FIFO;
+            else if(policy == "rr") cfg.policy = SCHED_RR;
+            else {
+                printf("%s: %s has unknown policy %s, should be other, fifo or rr\n", path.c_str(), node.name().c_str(), policy.c_str());
+                return false;
+            }
+            cfg.priority = node["priority"].empty() ? 0 : (int)node["priority"];
+        }
+        loaded[node.name()] = cfg;
+    }
+    threads = loaded;
+    return true;
+}
+
+const thread_config *thread_topology::get(const string &role) const {
+    auto it = threads.find(role);
+    return it == threads.end() ? nullptr : &it->second;
+}
+
+bool apply_thread(const thread_topology &topo, const string &role, int index){
+    // Linux limits names to 15 characters
+    string name = "fb-" + role + (index >= 0 ? to_string(index) : "");
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+    {
+        lock_guard<mutex> lock(registry_mutex);
+        registry.push_back({name, gettid()});
+    }
+
+    const thread_config *cfg = topo.get(role);
+    if(!cfg) return true;
+    bool ok = true;
+    if(!cfg->cpus.empty()){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(int cpu : cfg->cpus) CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if(err != 0){
+            printf("%s: setting CPUs failed: %s\n", name.c_str(), strerror(err));
+            ok = false;
+        }
+    }
+    if(cfg->set_sched){
+        sched_param param = {};
+        if(cfg->policy != SCHED_OTHER) param.sched_priority = cfg->priority;
+        int err = pthread_setschedparam(pthread_self(), cfg->policy, &param);
+        if(err != 0){
+            printf("%s: setting policy %d priority %d failed: %s\n", name.c_str(), cfg->policy, cfg->priority, strerror(err));
+            ok = false;
+        }
+        // Nice is per thread on Linux
+        if(cfg->policy == SCHED_OTHER && setpriority(PRIO_PROCESS, gettid(), cfg->priority) != 0){
+            printf("%s: setting nice %d failed: %s\n", name.c_str(), cfg->priority, strerror(errno));
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+vector<thread_stats> thread_report(){
+    vector<pair<string, int>> threads;
+    {
+        lock_guard<mutex> lock(registry_mutex);
+        threads = registry;
+    }
+    vector<thread_stats> out;
+    for(auto &[name, tid] : threads){
+        thread_stats st = {name, tid, -1, 0, 0, -1};
+        string dir = "/proc/self/task/" + to_string(tid) + "/";
+        ifstream status(dir + "status");
+        // Thread has exited
+        if(!status) continue;
+        string line;
+        while(getline(status, line)){
+            if(line.rfind("voluntary_ctxt_switches:", 0) == 0) st.n_voluntary = stol(line.substr(line.find(':') + 1));
+            else if(line.rfind("nonvoluntary_ctxt_switches:", 0) == 0) st.n_involuntary = stol(line.substr(line.find(':') + 1));
+        }
+        // Needs CONFIG_SCHED_DEBUG, most distro kernels have it
+        ifstream sched(dir + "sched");
+        while(getline(sched, line)){
+            if(line.rfind("se.nr_migrations", 0) == 0) st.n_migrations = stol(line.substr(line.find(':') + 1));
+        }
+        // Field 39 of stat, after the parenthesised name which can have spaces
+        ifstream stat(dir + "stat");
+        if(getline(stat, line)){
+            size_t pos = line.rfind(')');
+            int field = 2;
+            for(size_t i = pos + 1; i < line.size() && field < 39; ++i){
+                if(line[i] == ' ' && ++field == 39) st.cpu = atoi(line.c_str() + i + 1);
+            }
+        }
+        out.push_back(st);
+    }
+    return out;
+}
+
+/******************************************************************************
+ * Frame event
+ ******************************************************************************/
+
+frame_event::frame_event(){
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fd < 0) printf("eventfd failed: %s\n", strerror(errno));
+}
+
+frame_event::~frame_event(){
+    if(fd >= 0) close(fd);
+}
+
+void frame_event::notify(){
+    uint64_t one = 1;
+    // Only fails if the counter would overflow, nothing to do about that
+    ssize_t n = write(fd, &one, sizeof(one));
+    (void)n;
+}
+
+long frame_event::wait_until(const timespec &deadline){
+    pollfd p = {fd, POLLIN, 0};
+    for(;;){
+        uint64_t count;
+        if(read(fd, &count, sizeof(count)) == sizeof(count)) return count;
+
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left = ts_diff(deadline, now);
+        if(left <= 0) return 0;
+        timespec timeout = {left / ns_per_s, left % ns_per_s};
+        ppoll(&p, 1, &timeout, nullptr);
+    }
+}
+
+/******************************************************************************
+ * Fixed rate loop
+ ******************************************************************************/
+
+void rate_loop::start(){
+    clock_gettime(CLOCK_MONOTONIC, &t_wake);
+    deadline = t_wake;
+    ts_add(deadline, period_ns);
+}
+
+void rate_loop::wait(){
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stats.tick_hist.add(ts_diff(now, t_wake) / 1e3);
+    stats.n_ticks.fetch_add(1, memory_order_relaxed);
+
+    if(ts_diff(now, deadline) > 0){
+        stats.n_overruns.fetch_add(1, memory_order_relaxed);
+        // Lost a whole period or more, start again from here
+        long late = ts_diff(now, deadline);
+        if(late > period_ns){
+            long skip = late / period_ns;
+            ts_add(deadline, skip * period_ns);
+            stats.n_skipped.fetch_add(skip, memory_order_relaxed);
+        }
+    }
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_wake);
+    stats.jitter_hist.add(ts_diff(t_wake, deadline) / 1e3);
+    ts_add(deadline, period_ns);
+}
+
+bool rate_loop::wait(frame_event &ev){
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stats.tick_hist.add(ts_diff(now, t_wake) / 1e3);
+    stats.n_ticks.fetch_add(1, memory_order_relaxed);
+
+    // Fallback runs off the last wake up, not a fixed phase
+    deadline = t_wake;
+    ts_add(deadline, period_ns);
+    long n_frames = ev.wait_until(deadline);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_wake);
+    if(n_frames > 0){
+        stats.n_frame_ticks.fetch_add(1, memory_order_relaxed);
+        stats.n_frames_merged.fetch_add(n_frames - 1, memory_order_relaxed);
+    } else {
+        stats.n_timer_ticks.fetch_add(1, memory_order_relaxed);
+    }
+    return n_frames > 0;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+/******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <atomic>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "stats.hpp"
+
+using namespace std;
+
+/******************************************************************************
+ * Constants
+ ******************************************************************************/
+
+// Control loop rate unless --loop-rate says otherwise
+const double default_loop_hz = 1000;
+
+// SCHED_FIFO priority for the control loop with --rt. Below the kernel's
+// threaded IRQ handlers (50) would starve the NIC QTM comes in on, so above
+const int default_rt_priority = 80;
+
+// With --frame-ticks the loop still ticks this often when no frames come in,
+// so timed steps finish with QTM stopped
+const double frame_fallback_ms = 10;
+
+/******************************************************************************
+ * Real-time setup
+ ******************************************************************************/
+
+/**
+ * Locks current and future pages into RAM so the loop never page faults.
+ * Prints why and returns false if not allowed (needs CAP_IPC_LOCK or a high
+ * enough memlock ulimit)
+ */
+bool lock_memory();
+
+/**
+ * Switches the calling thread to SCHED_FIFO at priority. Threads it creates
+ * afterwards inherit it, so call once the others are started. Prints why and
+ * returns false if not allowed (needs CAP_SYS_NICE or an rtprio ulimit)
+ */
+bool set_fifo(int priority);
+
+/******************************************************************************
+ * Thread topology
+ ******************************************************************************/
+
+/**
+ * Where one thread runs and how it's scheduled. Fields left out of the config
+ * are left as inherited from whoever started the thread
+ */
+struct thread_config {
+    vector<int> cpus; // Empty for unchanged
+    bool set_sched = false;
+    int policy = 0; // SCHED_OTHER/FIFO/RR
+    int priority = 0; // 1-99 for FIFO/RR, nice for OTHER
+};
+
+/**
+ * Config per thread by role: control, qtm, motor, port, uws, input. See
+ * assets/config/threads.yml
+ */
+struct thread_topology {
+    map<string, thread_config> threads;
+
+    /**
+     * Loads an OpenCV yml file. Returns false and prints why if it's missing
+     * or malformed, leaving threads as they were
+     */
+    bool load(const string &path);
+    // nullptr if the role isn't configured
+    const thread_config *get(const string &role) const;
+};
+
+/**
+ * Names the calling thread fb-<role><index> (index < 0 for none), registers
+ * it for thread_report and applies its config, if any. Prints and returns
+ * false if some of it couldn't be applied
+ */
+bool apply_thread(const thread_topology &topo, const string &role, int index = -1);
+
+struct thread_stats {
+    string name;
+    int tid;
+    int cpu; // Last ran on
+    long n_voluntary, n_involuntary; // Context switches
+    long n_migrations; // -1 if the kernel doesn't expose it
+};
+
+/**
+ * Context switches and migrations of every thread that went through
+ * apply_thread, from /proc. A few syscalls per thread, not for every tick
+ */
+vector<thread_stats> thread_report();
+
+/******************************************************************************
+ * Frame event
+ ******************************************************************************/
+
+/**
+ * eventfd the QTM thread signals on every published frame, so the control
+ * loop can sleep until there's something new instead of polling
+ */
+struct frame_event {
+    int fd;
+
+    frame_event();
+    ~frame_event();
+
+    // From the publishing thread, one write syscall
+    void notify();
+
+    /**
+     * Sleeps until notified or the CLOCK_MONOTONIC deadline passes. Returns
+     * the number of notifies since the last wait, 0 on timeout
+     */
+    long wait_until(const timespec &deadline);
+};
+
+/******************************************************************************
+ * Fixed rate loop
+ ******************************************************************************/
+
+/**
+ * Written by the loop's thread, read for display
+ */
+struct loop_stats {
+    histogram<200> jitter_hist{5}; // Wake up after the deadline, us
+    histogram<200> tick_hist{10}; // Wake up to end of work, us
+    atomic<long> n_ticks{0};
+    atomic<long> n_overruns{0}; // Work ran past the next deadline
+    atomic<long> n_skipped{0}; // Whole periods dropped to get back in phase
+    // Frame triggered ticks only
+    atomic<long> n_frame_ticks{0}, n_timer_ticks{0};
+    atomic<long> n_frames_merged{0}; // Frames that came in while a tick ran
+};
+
+/**
+ * Runs a loop at a fixed period off absolute CLOCK_MONOTONIC deadlines, so
+ * the rate doesn't drift with how long each tick takes. A tick that overruns
+ * starts the next one late rather than squeezing it; if more than a whole
+ * period was lost the missed deadlines are skipped instead of bunched up
+ */
+struct rate_loop {
+    long period_ns;
+    timespec deadline = {};
+    timespec t_wake = {};
+    loop_stats stats;
+
+    rate_loop(double hz) : period_ns(1e9 / hz) {}
+
+    // First deadline is one period from now
+    void start();
+    // End of a tick's work, sleeps until the next deadline
+    void wait();
+    /**
+     * End of a tick's work, sleeps until ev fires or a period has passed
+     * since the last wake up. Returns whether it was a frame
+     */
+    bool wait(frame_event &ev);
+};
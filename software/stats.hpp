@@ -0,0 +1,57 @@
+#pragma once
+
+/******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <atomic>
+#include <cstdint>
+#include <cmath>
+
+using namespace std;
+
+/******************************************************************************
+ * Histogram
+ ******************************************************************************/
+
+/**
+ * Fixed bin histogram, last bin catches everything above range. Single writer,
+ * counts are relaxed atomics so other threads can read them for display
+ */
+template<int N>
+struct histogram {
+    double bin_width;
+    atomic<uint64_t> bins[N] = {};
+    atomic<uint64_t> n{0};
+    atomic<double> max_val{0}, sum{0};
+
+    histogram(double bin_width) : bin_width(bin_width) {}
+
+    void add(double x){
+        int b = x <= 0 ? 0 : (int)min<double>(x / bin_width, N - 1);
+        bins[b].fetch_add(1, memory_order_relaxed);
+        n.fetch_add(1, memory_order_relaxed);
+        sum.store(sum.load(memory_order_relaxed) + x, memory_order_relaxed);
+        if(x > max_val.load(memory_order_relaxed)) max_val.store(x, memory_order_relaxed);
+    }
+
+    /**
+     * Upper edge of the bin containing the pth percentile, p in [0, 1]
+     */
+    double percentile(double p) const {
+        uint64_t total = n.load(memory_order_relaxed);
+        if(total == 0) return 0;
+        uint64_t target = ceil(p * total), acc = 0;
+        for(int b = 0; b < N; ++b){
+            acc += bins[b].load(memory_order_relaxed);
+            if(acc >= target) return b == N - 1 ? max_val.load(memory_order_relaxed) : (b + 1) * bin_width;
+        }
+        return max_val.load(memory_order_relaxed);
+    }
+
+    double mean() const {
+        uint64_t total = n.load(memory_order_relaxed);
+        return total == 0 ? 0 : sum.load(memory_order_relaxed) / total;
+    }
+};
+
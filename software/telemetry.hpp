@@ -0,0 +1,77 @@
+#pragma once
+
+/******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <atomic>
+#include <cstdint>
+
+#include "physical_params.hpp"
+#include "stats.hpp"
+
+using namespace std;
+
+/******************************************************************************
+ * Constants
+ ******************************************************************************/
+
+// Viewer redraws at the display rate, no point sending faster by default
+const double default_telemetry_hz = 60;
+const uint32_t telemetry_version = 1;
+// uWS topic every viewer is subscribed to
+const char telemetry_topic[] = "telemetry";
+// Per client send buffer. A slow client skips frames once this is queued
+// rather than falling seconds behind
+const unsigned int telemetry_max_backpressure = 64 * 1024;
+
+/******************************************************************************
+ * Frame format
+ ******************************************************************************/
+
+/*
+ * One binary websocket message, little endian, no padding. Read by
+ * frontend/app.js, bump telemetry_version if this changes:
+ *
+ *   uint32_t version     telemetry_version
+ *   uint32_t seq         Frames sent so far
+ *   uint32_t state       state_t of the control loop
+ *   float    red_pos[4]  Our rods, fraction of linear range, rod_t order
+ *   float    red_rot[4]  deg
+ *   float    red_vel[4]  Linear velocity from the motion profile, cm/s
+ *   float    blue_pos[4] Human rods from the cameras, fraction of range,
+ *                        0.5 when not seen
+ *   float    blue_rot[4] deg, 0 when not seen
+ *   float    ball_pos[3] Fraction of play_height, play_width, 0
+ *   float    ball_vel[3] cm/s
+ */
+struct telemetry_frame {
+    uint32_t version;
+    uint32_t seq;
+    uint32_t state;
+    float red_pos[num_rod_t];
+    float red_rot[num_rod_t];
+    float red_vel[num_rod_t];
+    float blue_pos[num_rod_t];
+    float blue_rot[num_rod_t];
+    float ball_pos[3];
+    float ball_vel[3];
+};
+static_assert(sizeof(telemetry_frame) == 3*4 + 5*num_rod_t*4 + 6*4, "telemetry_frame should be packed");
+
+/******************************************************************************
+ * Stats
+ ******************************************************************************/
+
+/**
+ * Cost and volume of the broadcast. build_hist is written by the control
+ * loop, the rest by the uWS thread
+ */
+struct telemetry_stats {
+    histogram<100> build_hist{1}; // Filling the frame and deferring it, us
+    histogram<100> publish_hist{5}; // app.publish to every subscriber, us
+    atomic<long> n_frames{0};
+    atomic<long> n_bytes{0}; // Summed over subscribers
+    atomic<long> n_dropped{0}; // Messages uWS dropped for backpressure
+    atomic<int> n_clients{0};
+};
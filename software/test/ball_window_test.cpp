@@ -0,0 +1,211 @@
+#include "estimator.hpp"
+#include "capture.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Checks ball_window gives the same ball_pos_slow/ball_vel/ball_in_motion as
+ * the old full rescan of pos_buffer in the QTM thread, on random sequences and
+ * optionally a recorded capture:
+ *
+ *   ball_window_test [--capture <file>]
+ *
+ * Exits non-zero on the first sequence that doesn't match
+ */
+
+// Incremental sums drift a little from the rescan, this is way under a marker's noise
+const double pos_tol = 1e-6; // cm
+const double vel_tol = 1e-4; // cm/s
+
+/******************************************************************************
+ * Old estimator
+ ******************************************************************************/
+
+/**
+ * The pos_buffer EWMA and ball_in_motion from before ball_window, kept as is
+ */
+struct old_pos_buffer {
+    deque<vector<double>> pos_buffer;
+    const int buf_cap = vision_fps;
+    vector<double> ball_pos_slow = {0, 0, 0};
+    vector<double> ball_vel = {0, 0, 0};
+    bool ball_in_motion = false;
+
+    // Returns false while there aren't enough frames, same as the old continue
+    bool push(const vector<double> &ball_pos_fast){
+        pos_buffer.push_front(ball_pos_fast);
+        if((int)pos_buffer.size() < buf_cap) return false;
+        pos_buffer.pop_back();
+        // EWMA
+        double vel[3] = {0,0,0}, pos[3] = {0,0,0}, denom_vel = 0, denom_pos = 0;
+        for(int i = 0; i < (int)pos_buffer.size()-1; ++i){
+            double scale_vel = exp(-gamma_vel * i);
+            double scale_pos = exp(-gamma_pos * i);
+            denom_vel += scale_vel;
+            denom_pos += scale_pos;
+            for(int j = 0; j < 3; ++j){
+                vel[j] += (pos_buffer[i][j] - pos_buffer[i+1][j]) * scale_vel * vision_fps;
+                pos[j] += pos_buffer[i][j] * scale_pos;
+            }
+        }
+
+        double max[2] = {0,-play_width/2}, min[2] = {play_height, play_width/2};
+        for(int i = 0; i < vision_fps/3; ++i){
+            for(int j = 0; j < 2; ++j){
+                if(pos_buffer[i][j] > max[j]) max[j] = pos_buffer[i][j];
+                if(pos_buffer[i][j] < min[j]) min[j] = pos_buffer[i][j];
+            }
+        }
+        ball_in_motion = max[0] - min[0] > 1 || max[1] - min[1] > 1;
+
+        for(int j = 0; j < 3; ++j){
+            ball_vel[j] = vel[j] / denom_vel;
+            ball_pos_slow[j] = pos[j] / denom_pos;
+        }
+        return true;
+    }
+};
+
+/******************************************************************************
+ * Comparison
+ ******************************************************************************/
+
+int n_failed = 0;
+
+/**
+ * Feeds one sequence through both, frames where the ball wasn't seen are
+ * empty and repeat the last position like the old QTM thread did
+ */
+void compare(const char *name, const vector<vector<double>> &frames){
+    old_pos_buffer old_est;
+    ball_window ball_est;
+    double max_pos_err = 0, max_vel_err = 0;
+    long n_compared = 0, n_motion_diff = 0, n_ready_diff = 0;
+
+    for(const vector<double> &f : frames){
+        vector<double> p = f;
+        if(p.empty()){
+            if(old_est.pos_buffer.empty()) continue;
+            p = old_est.pos_buffer[0];
+        }
+        bool old_ready = old_est.push(p);
+        ball_est.push(p.data());
+        if(old_ready != ball_est.ready()) ++n_ready_diff;
+        if(!old_ready) continue;
+
+        for(int j = 0; j < 3; ++j){
+            max_pos_err = max(max_pos_err, abs(old_est.ball_pos_slow[j] - ball_est.pos(j)));
+            max_vel_err = max(max_vel_err, abs(old_est.ball_vel[j] - ball_est.vel(j)));
+        }
+        if(old_est.ball_in_motion != ball_est.in_motion()) ++n_motion_diff;
+        ++n_compared;
+    }
+
+    bool ok = n_compared > 0 && n_ready_diff == 0 && n_motion_diff == 0
+        && max_pos_err <= pos_tol && max_vel_err <= vel_tol;
+    printf("%s: %s, %ld frames, max pos err %g cm, max vel err %g cm/s, in motion mismatches %ld, ready mismatches %ld\n",
+            ok ? "ok" : "FAIL", name, n_compared, max_pos_err, max_vel_err, n_motion_diff, n_ready_diff);
+    if(!ok) ++n_failed;
+}
+
+/******************************************************************************
+ * Sequences
+ ******************************************************************************/
+
+// Uniformly random positions anywhere on the table, some frames missing
+vector<vector<double>> random_jumps(mt19937 &rng, int n){
+    uniform_real_distribution<double> x(0, play_height), y(-play_width/2, play_width/2), z(0, 2), u(0, 1);
+    vector<vector<double>> frames;
+    for(int i = 0; i < n; ++i){
+        if(u(rng) < 0.05) frames.push_back({});
+        else frames.push_back({x(rng), y(rng), z(rng)});
+    }
+    return frames;
+}
+
+// Ball that rolls, bounces off the walls and sits still with marker jitter,
+// so in_motion flips back and forth around its 1cm threshold
+vector<vector<double>> random_rolls(mt19937 &rng, int n){
+    uniform_real_distribution<double> x(5, play_height-5), speed(0, 400), angle(-M_PI, M_PI), u(0, 1);
+    normal_distribution<double> jitter(0, 0.2);
+    uniform_int_distribution<int> run(1, vision_fps);
+    vector<vector<double>> frames;
+    double p[3] = {x(rng), 0, ball_rad}, v[2] = {0, 0};
+    while((int)frames.size() < n){
+        double a = angle(rng), s = u(rng) < 0.3 ? 0 : speed(rng);
+        v[0] = s*cos(a);
+        v[1] = s*sin(a);
+        for(int i = run(rng); i > 0; --i){
+            p[0] += v[0] / vision_fps;
+            p[1] = clamp(p[1] + v[1] / vision_fps, -play_width/2, play_width/2);
+            reflect_walls(p[0], v[0]);
+            if(u(rng) < 0.02) frames.push_back({});
+            else frames.push_back({p[0] + jitter(rng), p[1] + jitter(rng), p[2] + jitter(rng)});
+        }
+    }
+    return frames;
+}
+
+// Ball positions from a capture, picked out of the markers the way the old
+// QTM thread did with the default translation only calibration
+bool recorded(const string &path, vector<vector<double>> &frames){
+    capture_reader reader;
+    if(!reader.open(path)) return false;
+    capture_frame frame;
+    while(reader.read(frame)){
+        vector<double> ball;
+        for(const capture_marker &m : frame.markers){
+            double p[3] = {m.x / 10 - cal_offset[0], m.y / 10 - cal_offset[1], m.z / 10 - cal_offset[2]};
+            p[0] += play_height / 2;
+            if(p[2] < 2){
+                ball = {p[0], p[1], p[2]};
+                break;
+            }
+        }
+        frames.push_back(ball);
+    }
+    return true;
+}
+
+int main(int argc, char **argv){
+    string capture_path;
+    for(int i = 1; i < argc; ++i){
+        string cmd = argv[i];
+        bool has_arg = i + 1 < argc;
+        if(cmd == "--capture" && has_arg){
+            capture_path = argv[++i];
+        } else {
+            printf("Usage: %s [--capture <file>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    mt19937 rng(1234);
+    compare("random jumps", random_jumps(rng, 20000));
+    compare("random rolls", random_rolls(rng, 100000));
+    // Stationary from the start, only ever jitter
+    {
+        normal_distribution<double> jitter(0, 0.1);
+        vector<vector<double>> frames;
+        for(int i = 0; i < 2000; ++i) frames.push_back({30 + jitter(rng), -10 + jitter(rng), ball_rad});
+        compare("still ball", frames);
+    }
+
+    if(!capture_path.empty()){
+        vector<vector<double>> frames;
+        if(!recorded(capture_path, frames)){
+            printf("Couldn't open capture %s\n", capture_path.c_str());
+            return 1;
+        }
+        compare(capture_path.c_str(), frames);
+    }
+
+    return n_failed > 0;
+}
@@ -0,0 +1,107 @@
+#include "motor.hpp"
+
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+
+/*
+ * Checks motor_dispatcher::wait coalescing keeps each axis in order. Exits
+ * non-zero on the first failure
+ */
+
+int n_failed = 0;
+
+void check(bool ok, const char *what){
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    if(!ok) ++n_failed;
+}
+
+bool is(const motor_op &op, motor_op_t type, double a){
+    return op.type == type && (isnan(a) ? isnan(op.a) : op.a == a);
+}
+
+int drain(motor_dispatcher &d, const vector<motor_op> &in, motor_op out[max_motor_ops]){
+    for(const motor_op &op : in) d.push(op);
+    return d.wait(out, 0);
+}
+
+int main(){
+    motor_cmds init = {};
+    auto now = chrono::steady_clock::now();
+    motor_op out[max_motor_ops];
+
+    {
+        // The move has to go out at v1, not whatever came before
+        motor_dispatcher d(init);
+        int n = drain(d, {{op_speed, lin, goalie, 10, 100, now}, {op_move, lin, goalie, 5, NAN, now}, {op_speed, lin, goalie, 20, 200, now}}, out);
+        check(n == 3 && is(out[0], op_speed, 10) && is(out[1], op_move, 5) && is(out[2], op_speed, 20),
+                "speed, move, speed keeps all three in order");
+    }
+    {
+        motor_dispatcher d(init);
+        int n = drain(d, {{op_speed, lin, goalie, 10, 100, now}, {op_vel, lin, goalie, 3, NAN, now}, {op_speed, lin, goalie, 20, NAN, now}}, out);
+        check(n == 3 && is(out[0], op_speed, 10) && is(out[1], op_vel, 3) && is(out[2], op_speed, 20) && isnan(out[2].b),
+                "speed, velocity move, speed keeps all three in order");
+    }
+    {
+        // Back to back speeds still merge, NAN taking the older value
+        motor_dispatcher d(init);
+        int n = drain(d, {{op_speed, lin, goalie, 10, 100, now}, {op_speed, lin, goalie, 20, NAN, now}, {op_move, lin, goalie, 5, NAN, now}}, out);
+        check(n == 2 && is(out[0], op_speed, 20) && out[0].b == 100 && is(out[1], op_move, 5),
+                "speed, speed, move merges the speeds");
+    }
+    {
+        // Superseded moves are still dropped, along with nothing else
+        motor_dispatcher d(init);
+        int n = drain(d, {{op_move, lin, goalie, 1, NAN, now}, {op_speed, lin, goalie, 10, 100, now}, {op_move, lin, goalie, 2, NAN, now}}, out);
+        check(n == 2 && is(out[0], op_speed, 10) && is(out[1], op_move, 2), "move, speed, move drops the first move");
+    }
+    {
+        // Other axes don't interfere
+        motor_dispatcher d(init);
+        int n = drain(d, {{op_speed, lin, goalie, 10, 100, now}, {op_move, rot, goalie, 5, NAN, now}, {op_speed, lin, goalie, 20, NAN, now}}, out);
+        check(n == 2 && is(out[0], op_move, 5) && out[0].axis == rot && is(out[1], op_speed, 20) && out[1].b == 100,
+                "a move on another axis is not a barrier");
+    }
+    {
+        // After a velocity watchdog stop the same velocity is sent again
+        motor_cmds cmds = {};
+        for(int a = 0; a < num_axis_t; ++a)
+            for(int r = 0; r < num_rod_t; ++r)
+                cmds.cmd[a][r] = {NAN, NAN, NAN};
+        motor_dispatcher d(cmds);
+        cmds.cmd[lin][goalie].track_vel = 30;
+        d.post(cmds);
+        int n = d.wait(out, 0);
+        d.post(cmds);
+        int n_same = d.wait(out, 0);
+        d.n_vel_timeouts.fetch_add(1);
+        d.post(cmds);
+        int n_resent = d.wait(out, 0);
+        check(n == 1 && n_same == 0 && n_resent == 1 && is(out[0], op_vel, 30), "velocity resent after a watchdog stop");
+    }
+    {
+        // Torque/stop made while the ring is full go out later, ahead of the next move
+        motor_cmds cmds = {};
+        for(int a = 0; a < num_axis_t; ++a)
+            for(int r = 0; r < num_rod_t; ++r)
+                cmds.cmd[a][r] = {NAN, NAN, NAN};
+        motor_dispatcher d(cmds);
+        while(d.push({op_query, rot, three_bar, NAN, NAN, now}));
+        d.torque(lin, goalie, 40);
+        d.stop(lin, goalie);
+        d.torque(lin, goalie, 100);
+        d.wait(out, 0);
+        cmds.cmd[lin][goalie].pos = 5;
+        d.post(cmds);
+        vector<motor_op> got;
+        for(int n; (n = d.wait(out, 0)) > 0;)
+            for(int i = 0; i < n; ++i)
+                if(out[i].axis == lin) got.push_back(out[i]);
+        check(got.size() == 3 && is(got[0], op_stop, NAN) && is(got[1], op_torque, 100) && is(got[2], op_move, 5),
+                "torque and stop held while the ring is full go out before the next move");
+    }
+
+    return n_failed ? 1 : 0;
+}
@@ -0,0 +1,136 @@
+#include "rt.hpp"
+#include "timing.hpp"
+#include "lockfree.hpp"
+#include "motor.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+/*
+ * Frame to command latency of the control loop, polled at a fixed rate and
+ * woken by frames (--frame-ticks). A synthetic QTM thread publishes vision
+ * snapshots and signals the frame event like the real one, the control loop
+ * posts a move per new frame and the motor thread times when it comes out of
+ * the dispatcher. No motors or cameras needed:
+ *
+ *   frame_tick_bench [--fps <hz>] [--loop-rate <hz>] [--seconds <s>] [--rt]
+ */
+
+struct bench_result {
+    histogram<400> tick_hist{10}; // Frame published to control tick seeing it, us
+    histogram<400> cmd_hist{10}; // Frame published to motor thread getting the move, us
+    long n_ticks = 0, n_stale = 0; // Stale: ticked without a new frame
+    long n_frames = 0;
+};
+
+void run(bool frame_ticks, double fps, double loop_hz, double seconds, bool use_rt, bench_result &res){
+    seqlock<vision_state> vision_snap;
+    vision_snap.publish({});
+    frame_event new_frame;
+    motor_cmds init;
+    for(int a = 0; a < num_axis_t; ++a)
+        for(int r = 0; r < num_rod_t; ++r)
+            init.cmd[a][r] = {NAN, NAN, NAN};
+    motor_dispatcher mtr_dispatch(init);
+    atomic<bool> quit{false};
+
+    // Frames on a fixed schedule plus random network delay. Without the delay
+    // frames phase lock to the control loop's deadlines and polling looks free
+    thread qtm_thread([&](){
+        rate_loop qtm_loop(fps);
+        mt19937 rng(1234);
+        uniform_real_distribution<double> delay_us(0, 1e6 / fps / 2);
+        qtm_loop.start();
+        vision_state vis = {};
+        while(!quit.load(memory_order_relaxed)){
+            this_thread::sleep_for(chrono::duration<double, micro>(delay_us(rng)));
+            vis.capture_ms = vis.publish_ms = now_ms();
+            vision_snap.publish(vis);
+            new_frame.notify();
+            ++res.n_frames;
+            qtm_loop.wait();
+        }
+    });
+
+    // The move's position is the frame's publish time, so the motor thread
+    // can tell which frame it came from
+    thread motor_thread([&](){
+        motor_op ops[max_motor_ops];
+        while(!quit.load(memory_order_relaxed)){
+            int n = mtr_dispatch.wait(ops, 10);
+            for(int i = 0; i < n; ++i){
+                if(ops[i].type != op_move) continue;
+                res.cmd_hist.add((now_ms() - ops[i].a) * 1000);
+                mtr_dispatch.issued(ops[i]);
+            }
+        }
+    });
+
+    if(use_rt) set_fifo(default_rt_priority);
+    rate_loop ctrl_loop(frame_ticks ? 1000 / frame_fallback_ms : loop_hz);
+    motor_cmds cmds = init;
+    double last_publish_ms = 0, t_end = now_ms() + seconds * 1000;
+    ctrl_loop.start();
+    while(now_ms() < t_end){
+        vision_state vis = vision_snap.read();
+        ++res.n_ticks;
+        if(vis.publish_ms != last_publish_ms && vis.publish_ms != 0){
+            res.tick_hist.add((now_ms() - vis.publish_ms) * 1000);
+            last_publish_ms = vis.publish_ms;
+            cmds.cmd[lin][goalie].pos = vis.publish_ms;
+            mtr_dispatch.post(cmds);
+        } else {
+            ++res.n_stale;
+        }
+        if(frame_ticks) ctrl_loop.wait(new_frame);
+        else ctrl_loop.wait();
+    }
+
+    quit.store(true);
+    qtm_thread.join();
+    motor_thread.join();
+}
+
+void print(const char *name, const bench_result &res){
+    printf("%-12s frame->tick p50/p99/max %5.0f/%5.0f/%5.0f us, frame->command p50/p99/max %5.0f/%5.0f/%5.0f us, "
+            "%ld frames, %ld ticks, %ld stale\n", name,
+            res.tick_hist.percentile(0.5), res.tick_hist.percentile(0.99), res.tick_hist.max_val.load(),
+            res.cmd_hist.percentile(0.5), res.cmd_hist.percentile(0.99), res.cmd_hist.max_val.load(),
+            res.n_frames, res.n_ticks, res.n_stale);
+}
+
+int main(int argc, char **argv){
+    double fps = vision_fps, loop_hz = default_loop_hz, seconds = 3;
+    bool use_rt = false;
+    for(int i = 1; i < argc; ++i){
+        string cmd = argv[i];
+        bool has_arg = i + 1 < argc;
+        if(cmd == "--fps" && has_arg){
+            fps = stod(argv[++i]);
+        } else if(cmd == "--loop-rate" && has_arg){
+            loop_hz = stod(argv[++i]);
+        } else if(cmd == "--seconds" && has_arg){
+            seconds = stod(argv[++i]);
+        } else if(cmd == "--rt"){
+            use_rt = true;
+        } else {
+            printf("Usage: %s [--fps <hz>] [--loop-rate <hz>] [--seconds <s>] [--rt]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(use_rt) lock_memory();
+
+    bench_result polled, triggered;
+    run(false, fps, loop_hz, seconds, use_rt, polled);
+    run(true, fps, loop_hz, seconds, use_rt, triggered);
+    char name[32];
+    snprintf(name, sizeof(name), "%.0f Hz:", loop_hz);
+    print(name, polled);
+    print("on frames:", triggered);
+    return 0;
+}
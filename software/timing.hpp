@@ -0,0 +1,62 @@
+#pragma once
+
+/******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/******************************************************************************
+ * Clock
+ ******************************************************************************/
+
+/**
+ * Monotonic host time in ms. Everything that timestamps on the host (vision,
+ * motors, control loop) uses this so the times can be compared directly
+ */
+inline double now_ms(){
+    return chrono::duration<double, milli>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/******************************************************************************
+ * Phase timing
+ ******************************************************************************/
+
+/**
+ * Named phases with start and end times, for the startup report. Phases can
+ * be added from any thread and overlap
+ */
+struct phase_log {
+    struct phase {
+        string name;
+        double t_start, t_end;
+    };
+
+    double t_origin = now_ms();
+    mutex m;
+    vector<phase> phases;
+
+    void add(const string &name, double t_start, double t_end){
+        lock_guard<mutex> lock(m);
+        phases.push_back({name, t_start, t_end});
+    }
+
+    // Sorted by start, times relative to t_origin
+    void print(){
+        lock_guard<mutex> lock(m);
+        sort(phases.begin(), phases.end(), [](const phase &a, const phase &b){ return a.t_start < b.t_start; });
+        printf("Startup:\n");
+        for(const phase &p : phases){
+            printf("  %-36s %8.1fms -> %8.1fms  (%.1fms)\n", p.name.c_str(),
+                    p.t_start - t_origin, p.t_end - t_origin, p.t_end - p.t_start);
+        }
+        printf("  Ready after %.1fms\n", now_ms() - t_origin);
+    }
+};
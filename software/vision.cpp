@@ -0,0 +1,221 @@
+#include "vision.hpp"
+#include "algo.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <opencv2/core.hpp>
+
+using namespace std;
+
+/******************************************************************************
+ * QTM clock
+ ******************************************************************************/
+
+void qtm_clock::update(uint64_t qtm_us, uint32_t frame_number, double host_ms){
+    const double block_ms = 1000;
+    // Anything this far off is a restarted stream, not drift
+    const double max_drift = 1e-3;
+
+    double qtm_ms = qtm_us / 1000.0;
+    double d = host_ms - qtm_ms;
+
+    // QTM restarted or this is the first frame
+    if(!initialized || frame_number <= last_frame || qtm_us <= last_qtm_us){
+        initialized = true;
+        last_qtm_us = qtm_us;
+        last_frame = frame_number;
+        dt_s = 1.0 / vision_fps;
+        offset_ms = block_min = d;
+        base_qtm_ms = block_min_qtm_ms = block_start_qtm_ms = qtm_ms;
+        have_prev = false;
+        drift = 0;
+        ++n_frames;
+        return;
+    }
+
+    uint32_t frames = frame_number - last_frame;
+    n_dropped += frames - 1;
+    ++n_frames;
+
+    dt_s = (qtm_us - last_qtm_us) / 1e6;
+    // Timestamps missing or nonsense, fall back to frame count
+    if(dt_s <= 0 || dt_s > 1) dt_s = frames / (double)vision_fps;
+    fps += 0.01 * (frames / dt_s - fps);
+    interval_hist.add(dt_s * 1000 / frames);
+
+    last_qtm_us = qtm_us;
+    last_frame = frame_number;
+
+    // Faster than anything seen so far, envelope moves down straight away
+    double residual = d - (offset_ms + drift * (qtm_ms - base_qtm_ms));
+    if(residual < 0){
+        offset_ms += residual;
+        residual = 0;
+    }
+    delay_hist.add(residual);
+
+    if(d < block_min){
+        block_min = d;
+        block_min_qtm_ms = qtm_ms;
+    }
+    if(qtm_ms - block_start_qtm_ms > block_ms){
+        if(have_prev){
+            double slope = (block_min - prev_min) / (block_min_qtm_ms - prev_min_qtm_ms);
+            if(abs(slope) < max_drift) drift += 0.2 * (slope - drift);
+        }
+        prev_min = block_min;
+        prev_min_qtm_ms = block_min_qtm_ms;
+        have_prev = true;
+
+        // Re-anchor so the envelope can also move up
+        offset_ms = block_min;
+        base_qtm_ms = block_min_qtm_ms;
+
+        block_min = d;
+        block_min_qtm_ms = block_start_qtm_ms = qtm_ms;
+    }
+}
+
+double qtm_clock::capture_host_ms(uint64_t qtm_us) const {
+    double qtm_ms = qtm_us / 1000.0;
+    return qtm_ms + offset_ms + drift * (qtm_ms - base_qtm_ms) - vision_latency_ms;
+}
+
+/******************************************************************************
+ * Calibration
+ ******************************************************************************/
+
+qtm_calibration::qtm_calibration(){
+    // mm to cm, then offset, then 0 at edge of table
+    float t[3] = {
+        (float)(-cal_offset[0] + play_height / 2),
+        (float)-cal_offset[1],
+        (float)-cal_offset[2]
+    };
+    for(int i = 0; i < 3; ++i){
+        for(int j = 0; j < 3; ++j) m[i][j] = i == j ? 0.1 : 0;
+        m[i][3] = t[i];
+    }
+}
+
+bool qtm_calibration::load(const string &path){
+    cv::FileStorage fs(path, cv::FileStorage::READ);
+    if(!fs.isOpened()) return false;
+    cv::Mat mat;
+    fs["qtm_to_table"] >> mat;
+    if(mat.rows != 4 || mat.cols != 4){
+        printf("%s: qtm_to_table should be 4x4\n", path.c_str());
+        return false;
+    }
+    mat.convertTo(mat, CV_64F);
+    if(mat.at<double>(3, 0) != 0 || mat.at<double>(3, 1) != 0
+            || mat.at<double>(3, 2) != 0 || mat.at<double>(3, 3) != 1){
+        printf("%s: qtm_to_table should be affine, last row 0 0 0 1\n", path.c_str());
+        return false;
+    }
+    for(int i = 0; i < 3; ++i)
+        for(int j = 0; j < 4; ++j)
+            m[i][j] = mat.at<double>(i, j);
+    return true;
+}
+
+// GCC/clang vector extension, compiles to whatever SIMD the target has
+typedef float vec_f __attribute__((vector_size(simd_width * sizeof(float))));
+
+void marker_batch::transform(const qtm_calibration &cal){
+    const auto &m = cal.m;
+    for(int i = 0; i < n; i += simd_width){
+        vec_f vx, vy, vz;
+        memcpy(&vx, x + i, sizeof(vec_f));
+        memcpy(&vy, y + i, sizeof(vec_f));
+        memcpy(&vz, z + i, sizeof(vec_f));
+        vec_f tx = vx * m[0][0] + vy * m[0][1] + vz * m[0][2] + m[0][3];
+        vec_f ty = vx * m[1][0] + vy * m[1][1] + vz * m[1][2] + m[1][3];
+        vec_f tz = vx * m[2][0] + vy * m[2][1] + vz * m[2][2] + m[2][3];
+        memcpy(x + i, &tx, sizeof(vec_f));
+        memcpy(y + i, &ty, sizeof(vec_f));
+        memcpy(z + i, &tz, sizeof(vec_f));
+    }
+}
+
+/******************************************************************************
+ * Marker association
+ ******************************************************************************/
+
+double rod_y(int side, int rod){
+    return side == bot ? rod_coord[rod] : -rod_coord[rod];
+}
+
+marker_assoc::result marker_assoc::associate(const marker_batch &markers, const double *ball_pred, const double *ball_std, double dt){
+    auto t_start = chrono::steady_clock::now();
+    result res;
+    res.ball = -1;
+    for(int s = 0; s < num_side_t; ++s)
+        for(int r = 0; r < num_rod_t; ++r)
+            res.hat[s][r] = -1;
+
+    int n = markers.n;
+    const float *mx = markers.x, *my = markers.y, *mz = markers.z;
+
+    // Ball
+    bool lost = !ball_tracked || ball_misses > ball_reacquire_frames;
+    double gate = max_ball_speed * dt;
+    if(ball_pred && ball_std)
+        gate = max(gate, ball_gate_sigma * hypot(ball_std[0], ball_std[1]));
+    const double *center = ball_pred && !lost ? ball_pred : ball_last;
+    double best_dist = INFINITY;
+    int n_candidates = 0;
+    for(int m = 0; m < n; ++m){
+        if(mz[m] >= ball_max_z) continue;
+        ++n_candidates;
+        double dist = hypot(mx[m] - center[0], my[m] - center[1]);
+        if(!lost && dist > gate) continue;
+        if(dist < best_dist){
+            best_dist = dist;
+            res.ball = m;
+        }
+    }
+    if(res.ball >= 0){
+        n_ball_rejected += n_candidates - 1;
+        ball_last[0] = mx[res.ball];
+        ball_last[1] = my[res.ball];
+        ball_last[2] = mz[res.ball];
+        ball_tracked = true;
+        ball_misses = 0;
+    } else {
+        n_ball_rejected += n_candidates;
+        ++ball_misses;
+    }
+
+    // Hats
+    double best_hat[num_side_t][num_rod_t];
+    for(int s = 0; s < num_side_t; ++s)
+        for(int r = 0; r < num_rod_t; ++r)
+            best_hat[s][r] = INFINITY;
+    for(int m = 0; m < n; ++m){
+        if(mz[m] <= plr_height) continue;
+        auto [side, rod] = closest_rod(my[m]);
+        if(abs(my[m] - rod_y(side, rod)) > hat_height + 1) continue;
+        double dist = hat_tracked[side][rod]
+            ? hypot(mx[m] - hat_last[side][rod][0], my[m] - hat_last[side][rod][1])
+            : 0;
+        if(dist < best_hat[side][rod]){
+            best_hat[side][rod] = dist;
+            res.hat[side][rod] = m;
+        }
+    }
+    for(int s = 0; s < num_side_t; ++s){
+        for(int r = 0; r < num_rod_t; ++r){
+            if(res.hat[s][r] < 0) continue;
+            int m = res.hat[s][r];
+            hat_last[s][r][0] = mx[m];
+            hat_last[s][r][1] = my[m];
+            hat_last[s][r][2] = mz[m];
+            hat_tracked[s][r] = true;
+        }
+    }
+
+    cost_hist.add(chrono::duration<double, micro>(chrono::steady_clock::now() - t_start).count());
+    return res;
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+/******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <cstdint>
+#include <string>
+
+#include "physical_params.hpp"
+#include "stats.hpp"
+
+/******************************************************************************
+ * QTM clock
+ ******************************************************************************/
+
+/**
+ * Tracks the QTM capture clock against the host clock. Frame timestamps come
+ * from the cameras, so they're immune to network jitter, but they're on QTM's
+ * clock. The offset is estimated from the fastest frames seen (lower envelope
+ * of host - qtm time), refreshed every second so it follows drift.
+ */
+struct qtm_clock {
+    bool initialized = false;
+    uint64_t last_qtm_us = 0;
+    uint32_t last_frame = 0;
+
+    // Capture time between this frame and the last one, s
+    double dt_s = 1.0 / vision_fps;
+    // Smoothed measured frame rate
+    double fps = vision_fps;
+    long n_frames = 0, n_dropped = 0;
+
+    // host ms - qtm ms for the fastest frames, at qtm time base_qtm_ms
+    double offset_ms = 0, base_qtm_ms = 0;
+    // Relative drift of the two clocks, ms/ms
+    double drift = 0;
+
+    // Lowest host - qtm of the current one second block
+    double block_min = 0, block_min_qtm_ms = 0, block_start_qtm_ms = 0;
+    double prev_min = 0, prev_min_qtm_ms = 0;
+    bool have_prev = false;
+
+    // How much later than the fastest frames each frame arrived, ms
+    histogram<200> delay_hist{0.1};
+    // Capture interval between consecutive frames, ms
+    histogram<200> interval_hist{0.1};
+
+    /**
+     * Call once per received frame with the packet's timestamp and frame
+     * number and the host receive time
+     */
+    void update(uint64_t qtm_us, uint32_t frame_number, double host_ms);
+
+    /**
+     * When a frame with the given QTM timestamp was captured, on the host
+     * clock. Assumes the fastest frames took vision_latency_ms
+     */
+    double capture_host_ms(uint64_t qtm_us) const;
+};
+
+/******************************************************************************
+ * Calibration
+ ******************************************************************************/
+
+// Most markers we'll look at in one frame, the rest are ignored. Multiple of
+// simd_width
+const int max_markers = 64;
+// Floats per SIMD register, 8 for AVX. Also fine on narrower hardware, the
+// compiler just splits the vectors
+const int simd_width = 8;
+static_assert(max_markers % simd_width == 0);
+
+/**
+ * Affine transform from raw QTM coordinates (mm) to table coordinates (cm),
+ * the top three rows of a 4x4 homogeneous matrix. Rotation and scale go in the
+ * 3x3 part, so table tilt relative to the cameras is taken care of too.
+ *
+ * Defaults to the old translation only calibration from cal_offset
+ */
+struct qtm_calibration {
+    float m[3][4];
+
+    qtm_calibration();
+
+    /**
+     * Loads the 4x4 qtm_to_table matrix from an OpenCV yml file, see
+     * assets/calibration/qtm.yml. Returns false and leaves the calibration
+     * alone if the file is missing or malformed
+     */
+    bool load(const string &path);
+};
+
+/**
+ * One frame's markers, structure of arrays so the calibration can be applied
+ * to the whole frame a SIMD register at a time. Preallocated, nothing is
+ * allocated per frame
+ */
+struct marker_batch {
+    alignas(32) float x[max_markers] = {};
+    alignas(32) float y[max_markers] = {};
+    alignas(32) float z[max_markers] = {};
+    int n = 0;
+
+    void clear() { n = 0; }
+
+    // Returns false and drops the marker if the batch is full
+    bool add(float mx, float my, float mz){
+        if(n == max_markers) return false;
+        x[n] = mx;
+        y[n] = my;
+        z[n] = mz;
+        ++n;
+        return true;
+    }
+
+    /**
+     * Transforms all markers in place. Runs over whole registers, lanes past
+     * n get transformed too but are never read
+     */
+    void transform(const qtm_calibration &cal);
+};
+
+/******************************************************************************
+ * Marker association
+ ******************************************************************************/
+
+// Markers below this are ball candidates, above plr_height are hats. High
+// enough to keep the ball through jump shots
+const double ball_max_z = plr_height - 1;
+// Ball can't go faster than this, anything further from the prediction is a
+// reflection. Has to cover a hard shot off a resting ball, where the prediction
+// hasn't picked up any velocity yet, otherwise the shot gets gated out for
+// ball_reacquire_frames. Hard shots are around 15 m/s
+const double max_ball_speed = 2500;
+const double ball_gate_sigma = 4;
+// Frames without a gated ball before we accept a candidate anywhere, ball was
+// probably picked up and put down somewhere else
+const int ball_reacquire_frames = vision_fps / 10;
+
+/**
+ * Picks out the ball and hats from a frame's markers, keeping track identity
+ * across frames.
+ *
+ * Ball: nearest candidate to the filter's prediction inside a gate, so
+ * reflections and a second ball don't get mixed in.
+ *
+ * Hats: each rod only ever sees markers within a hat height of its own y, and
+ * those regions don't overlap, so per rod nearest neighbour to the last hat
+ * position is already the optimal assignment, no need for Hungarian.
+ */
+struct marker_assoc {
+    bool ball_tracked = false;
+    double ball_last[3] = {0, 0, 0};
+    int ball_misses = 0;
+    long n_ball_rejected = 0;
+
+    bool hat_tracked[num_side_t][num_rod_t] = {};
+    double hat_last[num_side_t][num_rod_t][3] = {};
+
+    // Time spent associating each frame, us
+    histogram<100> cost_hist{1};
+
+    struct result {
+        int ball; // -1 for not seen
+        int hat[num_side_t][num_rod_t]; // -1 for not seen
+    };
+
+    /**
+     * markers: table coordinates in cm
+     * ball_pred: predicted ball position this frame, nullptr if unknown
+     * ball_std: 1 sigma uncertainty of the prediction
+     * dt: time since last frame, s
+     */
+    result associate(const marker_batch &markers, const double *ball_pred, const double *ball_std, double dt);
+};
+
+/**
+ * y coordinate of a rod in table coordinates
+ */
+double rod_y(int side, int rod);